@@ -70,7 +70,37 @@ size_t XSDT::Count() const {
     return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
 }
 
+size_t MADT::LocalAPICIDs(uint8_t* apic_ids, size_t max_count) const {
+    // Interrupt controller structures follow the fixed fields
+    const auto entries = reinterpret_cast<const uint8_t*>(this + 1);
+    const auto entries_end = reinterpret_cast<const uint8_t*>(this) + this->header.length;
+
+    size_t count = 0;
+    for (auto p = entries; p + 2 <= entries_end && p[1] >= 2; p += p[1]) {
+        const uint8_t type = p[0];
+        if (type != 0) continue; // Processor Local APIC
+
+        uint32_t flags;
+        memcpy(&flags, p + 4, sizeof(flags));
+        if ((flags & 1) && count < max_count) { // Enabled
+            apic_ids[count++] = p[3];
+        }
+    }
+    return count;
+}
+
 const FADT* fadt;
+const MADT* madt;
+const HPET* hpet;
+
+uint32_t PMTimerCount() {
+    return IoIn32(fadt->pm_tmr_blk);
+}
+
+uint32_t PMTimerElapsed(uint32_t start, uint32_t end) {
+    const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+    return pm_timer_32 ? end - start : (end - start) & 0x00ffffffu;
+}
 
 void WaitMilliseconds(unsigned long msec) {
     const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -99,11 +129,16 @@ void Initialize(const RSDP& rsdp) {
     }
 
     fadt = nullptr;
+    madt = nullptr;
+    hpet = nullptr;
     for (int i = 0; i < xsdt.Count(); ++i) {
         const auto& entry = xsdt[i];
-        if (entry.IsValid("FACP")) {
+        if (fadt == nullptr && entry.IsValid("FACP")) {
             fadt = reinterpret_cast<const FADT*>(&entry);
-            break;
+        } else if (madt == nullptr && entry.IsValid("APIC")) {
+            madt = reinterpret_cast<const MADT*>(&entry);
+        } else if (hpet == nullptr && entry.IsValid("HPET")) {
+            hpet = reinterpret_cast<const HPET*>(&entry);
         }
     }
 
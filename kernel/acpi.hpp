@@ -50,9 +50,43 @@ struct FADT {
     char reserved3[276 - 116];
 } __attribute__((packed));
 
+struct MADT {
+    DescriptionHeader header;
+
+    uint32_t local_apic_address;
+    uint32_t flags;
+
+    // Stores the local APIC IDs of enabled processors, up to max_count, and
+    // returns the number of IDs stored
+    size_t LocalAPICIDs(uint8_t* apic_ids, size_t max_count) const;
+} __attribute__((packed));
+
+struct HPET {
+    DescriptionHeader header;
+
+    uint32_t event_timer_block_id;
+    // Generic Address Structure of the register block
+    uint8_t address_space_id;
+    uint8_t register_bit_width;
+    uint8_t register_bit_offset;
+    uint8_t access_size;
+    uint64_t base_address;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+} __attribute__((packed));
+
 extern const FADT* fadt;
+// nullptr when the firmware provides no MADT
+extern const MADT* madt;
+// nullptr when the firmware provides no HPET
+extern const HPET* hpet;
 const int kPMTimerFreq = 3579545;
 
+// Current count of the PM timer, which wraps at 24 or 32 bits
+uint32_t PMTimerCount();
+// Counts of the PM timer from start to end, which may have wrapped once
+uint32_t PMTimerElapsed(uint32_t start, uint32_t end);
 void WaitMilliseconds(unsigned long msec);
 void Initialize(const RSDP& rsdp);
 
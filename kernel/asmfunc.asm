@@ -81,6 +81,12 @@ SetCSSS:
     pop rbp
     ret
 
+; void LoadTR(uint16_t sel);
+global LoadTR
+LoadTR:
+    ltr di
+    ret
+
 ; void SetCR3(uint64_t value);
 global SetCR3
 SetCR3:
@@ -92,8 +98,88 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR2 ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+; void InvalidatePage(uint64_t addr);
+global InvalidatePage
+InvalidatePage:
+    invlpg [rdi]
+    ret
+
+global GetCR0 ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+; void SetCR0(uint64_t value);
+global SetCR0
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global GetCR4 ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+; void SetCR4(uint64_t value);
+global SetCR4
+SetCR4:
+    mov cr4, rdi
+    ret
+
+; void CPUID(uint32_t eax, uint32_t ecx,
+;            uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
+global CPUID
+CPUID:
+    push rbx ; rbx is callee-saved
+    mov r10, rdx
+    mov r11, rcx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+; void SetXCR0(uint64_t value);
+global SetXCR0
+SetXCR0:
+    xor ecx, ecx
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32 ; edx:eax = value
+    xsetbv
+    ret
+
+; uint64_t ReadMSR(uint32_t msr);
+global ReadMSR
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx ; rax = edx:eax
+    ret
+
+; void WriteMSR(uint32_t msr, uint64_t value);
+global WriteMSR
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32 ; edx:eax = value
+    wrmsr
+    ret
+
 extern kernel_main_stack
 extern KernelMainNewStack
+extern cr3_load_flags
 
 global KernelMain
 KernelMain:
@@ -103,6 +189,97 @@ KernelMain:
     hlt
     jmp .fin
 
+; Startup code of application processors. InitializeSMP copies the bytes
+; between ApTrampoline and ApTrampolineEnd to a frame below 1 MiB, whose
+; page number is the SIPI vector. The code only uses addresses relative to
+; the copy, except for the kernel symbols reached after leaving real mode.
+extern ap_boot_cr3
+extern ap_boot_stack_top
+extern ApMain
+
+bits 16
+global ApTrampoline
+ApTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    mov ss, ax
+    mov sp, 0x1000 ; the end of the frame
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4 ; ebx = physical address of the copy
+
+    lea eax, [ebx + ApTrampolineGDT - ApTrampoline]
+    mov [ApTrampolineGDTR - ApTrampoline + 2], eax
+    lgdt [ApTrampolineGDTR - ApTrampoline]
+
+    mov eax, cr0
+    and eax, 0x9fffffff ; clear CD and NW, which INIT sets
+    or eax, 1 ; PE
+    mov cr0, eax
+
+    lea eax, [ebx + ApTrampoline32 - ApTrampoline]
+    push dword 0x08 ; 32-bit code segment
+    push eax
+    o32 retf
+
+bits 32
+ApTrampoline32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lea esp, [ebx + 0x1000]
+
+    mov eax, cr4
+    or eax, 1 << 5 ; PAE
+    mov cr4, eax
+    mov eax, [ap_boot_cr3]
+    mov cr3, eax
+
+    mov ecx, 0xc0000080 ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8 ; LME
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31 ; PG
+    mov cr0, eax
+
+    push dword 0x18 ; 64-bit code segment
+    push dword ApEntry64
+    retf
+
+align 8
+ApTrampolineGDT:
+    dq 0
+    dq 0x00cf9a000000ffff ; 0x08: 32-bit code
+    dq 0x00cf92000000ffff ; 0x10: data
+    dq 0x00af9a000000ffff ; 0x18: 64-bit code
+ApTrampolineGDTR:
+    dw ApTrampolineGDTR - ApTrampolineGDT - 1
+    dd 0 ; filled in by the code above
+global ApTrampolineEnd
+ApTrampolineEnd:
+
+bits 64
+ApEntry64:
+    mov rsp, [ap_boot_stack_top]
+
+    ; SSE is off after INIT. Compiled code and fxsave need it.
+    mov rax, cr0
+    and rax, ~(1 << 2) ; EM
+    or rax, 1 << 1 ; MP
+    mov cr0, rax
+    mov rax, cr4
+    or rax, 3 << 9 ; OSFXSR, OSXMMEXCPT
+    mov cr4, rax
+
+    call ApMain
+.fin:
+    hlt
+    jmp .fin
+
 global SwitchContext
 SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     ; Move to current_ctx in rsi
@@ -142,8 +319,6 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
-
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
     push qword [rdi + 0x70] ; RSP
@@ -153,10 +328,19 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
 
     ; Restore next_context in rdi
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
+    ; FPU registers are switched lazily by the #NM handler on their first use
+    mov rax, cr0
+    or rax, 1 << 3 ; TS
+    mov cr0, rax
 
+    ; Reloading the same CR3 would only flush the TLB
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .cr3_loaded
+    or rax, [cr3_load_flags] ; bit 63 keeps TLB entries tagged with the PCID
     mov cr3, rax
+.cr3_loaded:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -180,3 +364,70 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov rdi, [rdi + 0x60]
 
     o64 iret
+
+extern cpu_index_of_apic
+extern fpu_owners
+extern fpu_save_mode
+
+; #NM handler. Compiled code may use SSE registers, which still hold the
+; state of the previous owner, so the whole switch is done here.
+global IntHandlerDeviceNotAvailable
+IntHandlerDeviceNotAvailable:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    clts
+
+    ; r8 = &fpu_owners[cpu_index_of_apic[local APIC ID]]
+    mov rax, 0xfee00020
+    mov eax, [rax]
+    shr eax, 24
+    movzx eax, byte [cpu_index_of_apic + rax]
+    shl eax, 4 ; sizeof(FPUOwner)
+    lea r8, [fpu_owners + rax]
+    mov rsi, [r8]     ; save area
+    mov rdi, [r8 + 8] ; restore area
+    cmp rsi, rdi
+    je .done
+
+    mov eax, -1
+    mov edx, -1 ; XSAVE components: all enabled in XCR0
+    mov ecx, [fpu_save_mode]
+
+    test rsi, rsi
+    jz .restore
+    cmp ecx, 1
+    je .xsave
+    ja .xsaveopt
+    fxsave64 [rsi]
+    jmp .restore
+.xsave:
+    xsave64 [rsi]
+    jmp .restore
+.xsaveopt:
+    xsaveopt64 [rsi]
+
+.restore:
+    test ecx, ecx
+    jnz .xrstor
+    fxrstor64 [rdi]
+    jmp .commit
+.xrstor:
+    xrstor64 [rdi]
+
+.commit:
+    ; Other processors may take the previous owner once they see the new
+    ; one. x86 keeps stores in order, so this store releases the save area.
+    mov [r8], rdi
+
+.done:
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
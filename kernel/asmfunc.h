@@ -10,7 +10,23 @@ extern "C" {
   void LoadGDT(uint16_t limit, uint64_t offset);
   void SetCSSS(uint16_t cs, uint16_t ss);
   void SetDSAll(uint16_t value);
+  void LoadTR(uint16_t sel);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR2();
+  void InvalidatePage(uint64_t addr);
+  uint64_t GetCR0();
+  void SetCR0(uint64_t value);
+  uint64_t GetCR4();
+  void SetCR4(uint64_t value);
+  void SetXCR0(uint64_t value);
+  uint64_t ReadMSR(uint32_t msr);
+  void WriteMSR(uint32_t msr, uint64_t value);
+  void CPUID(uint32_t eax, uint32_t ecx, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d);
   void SwitchContext(void* next_ctx, void* current_ctx);
+  // #NM handler, which switches the FPU state to the current task
+  void IntHandlerDeviceNotAvailable();
+  // Bounds of the startup code of application processors
+  extern const char ApTrampoline[];
+  extern const char ApTrampolineEnd[];
 }
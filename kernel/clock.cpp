@@ -0,0 +1,136 @@
+#include "clock.hpp"
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "hpet.hpp"
+#include "logger.hpp"
+
+namespace {
+
+const uint32_t kCPUIDInvariantTSC = 1u << 8; // CPUID.80000007H:EDX
+// The HPET runs at 10 MHz or more, so a short window is precise enough
+const uint64_t kHPETCalibrationMicroseconds = 2000;
+const uint64_t kPMTimerCalibrationMicroseconds = 10000;
+
+bool tsc_invariant = false;
+uint64_t tsc_freq;
+uint64_t tsc_origin;
+// CyclesToNanoseconds multiplies by this and shifts right by 32
+uint64_t ns_per_cycle_frac32;
+
+// NowNanoseconds reads the HPET instead of a TSC which is not invariant
+bool hpet_clock = false;
+uint64_t hpet_origin;
+uint64_t ns_per_hpet_count_frac32;
+
+bool DetectInvariantTSC() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) return false;
+    CPUID(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+    return edx & kCPUIDInvariantTSC;
+}
+
+// Returns the TSC frequency enumerated by CPUID leaf 0x15, or by leaf 0x16
+// when leaf 0x15 omits the crystal frequency. 0 if neither is available.
+uint64_t TSCFrequencyFromCPUID() {
+    uint32_t max_leaf, ebx, ecx, edx;
+    CPUID(0, 0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf < 0x15) return 0;
+
+    uint32_t denominator, numerator, crystal_hz;
+    CPUID(0x15, 0, &denominator, &numerator, &crystal_hz, &edx);
+    if (denominator == 0 || numerator == 0) return 0;
+    if (crystal_hz != 0) {
+        return static_cast<uint64_t>(crystal_hz) * numerator / denominator;
+    }
+
+    if (max_leaf < 0x16) return 0;
+    uint32_t base_mhz;
+    CPUID(0x16, 0, &base_mhz, &ebx, &ecx, &edx);
+    return static_cast<uint64_t>(base_mhz & 0xffff) * 1000000;
+}
+
+// Reads a reference counter and the TSC at the middle of the read, which
+// takes about a microsecond for the I/O port of the PM timer
+template<typename ReadCounter>
+uint64_t ReadTSCWith(ReadCounter read_counter, uint64_t& count) {
+    const uint64_t before = __builtin_ia32_rdtsc();
+    count = read_counter();
+    const uint64_t after = __builtin_ia32_rdtsc();
+    return before + (after - before) / 2;
+}
+
+// Measures the TSC against a reference counter running at counter_freq Hz
+// for about window_us microseconds
+template<typename ReadCounter, typename Elapsed>
+uint64_t CalibrateTSC(ReadCounter read_counter, Elapsed elapsed,
+                      uint64_t counter_freq, uint64_t window_us) {
+    uint64_t start, end;
+    const uint64_t tsc_start = ReadTSCWith(read_counter, start);
+    const uint64_t target = counter_freq * window_us / 1000000;
+    uint64_t tsc_end;
+    do {
+        tsc_end = ReadTSCWith(read_counter, end);
+    } while (elapsed(start, end) < target);
+
+    return static_cast<unsigned __int128>(tsc_end - tsc_start) * counter_freq / elapsed(start, end);
+}
+
+}
+
+void InitializeClock() {
+    tsc_invariant = DetectInvariantTSC();
+
+    const char* calibrated_by = "CPUID";
+    tsc_freq = TSCFrequencyFromCPUID();
+    if (tsc_freq == 0 && HPETAvailable()) {
+        calibrated_by = "HPET";
+        tsc_freq = CalibrateTSC(HPETCounter, HPETElapsed,
+                                HPETFrequency(), kHPETCalibrationMicroseconds);
+    } else if (tsc_freq == 0) {
+        calibrated_by = "PM timer";
+        tsc_freq = CalibrateTSC(
+            [] { return static_cast<uint64_t>(acpi::PMTimerCount()); },
+            [](uint64_t start, uint64_t end) {
+                return static_cast<uint64_t>(acpi::PMTimerElapsed(start, end));
+            },
+            acpi::kPMTimerFreq, kPMTimerCalibrationMicroseconds);
+    }
+    ns_per_cycle_frac32 = (1000000000ul << 32) / tsc_freq;
+    tsc_origin = __builtin_ia32_rdtsc();
+
+    hpet_clock = !tsc_invariant && HPETAvailable() && HPETCounter64Bit();
+    if (hpet_clock) {
+        ns_per_hpet_count_frac32 = (1000000000ul << 32) / HPETFrequency();
+        hpet_origin = HPETCounter();
+    }
+
+    Log(kInfo, "TSC: %lu kHz by %s%s\n", tsc_freq / 1000, calibrated_by,
+        tsc_invariant ? "" : " (not invariant)");
+    Log(kInfo, "clock source: %s\n", hpet_clock ? "HPET" : "TSC");
+}
+
+bool TSCInvariant() {
+    return tsc_invariant;
+}
+
+uint64_t TSCFrequency() {
+    return tsc_freq;
+}
+
+uint64_t CyclesToNanoseconds(uint64_t cycles) {
+    return static_cast<unsigned __int128>(cycles) * ns_per_cycle_frac32 >> 32;
+}
+
+uint64_t NanosecondsToCycles(uint64_t nsec) {
+    return static_cast<unsigned __int128>(nsec) * tsc_freq / 1000000000u;
+}
+
+uint64_t NowNanoseconds() {
+    if (hpet_clock) {
+        return static_cast<unsigned __int128>(HPETCounter() - hpet_origin)
+            * ns_per_hpet_count_frac32 >> 32;
+    }
+    return CyclesToNanoseconds(__builtin_ia32_rdtsc() - tsc_origin);
+}
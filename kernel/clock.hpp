@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Determine the TSC frequency from CPUID, or measure it against the HPET or
+ * the ACPI PM timer. ACPI and the HPET must be initialized. The clock reads
+ * the TSC when it is invariant and the HPET otherwise, if there is one.
+ */
+void InitializeClock();
+
+// True when the TSC runs at a constant rate in all power states
+bool TSCInvariant();
+// Frequency of the TSC in Hz
+uint64_t TSCFrequency();
+
+uint64_t CyclesToNanoseconds(uint64_t cycles);
+uint64_t NanosecondsToCycles(uint64_t nsec);
+
+/**
+ * Nanoseconds since InitializeClock. It only reads a counter, so it can be
+ * called from any processor, with or without interrupts.
+ */
+uint64_t NowNanoseconds();
+
+template<typename Func, typename Logger>
+void measure_with_TSC(const char* tag, Logger logger, Func execute) {
+    const auto start = NowNanoseconds();
+    execute();
+    const auto elapsed = NowNanoseconds() - start;
+    logger("%s: elapsed = %lu ns\n", tag, elapsed);
+}
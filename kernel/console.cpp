@@ -4,6 +4,8 @@
 #include "font.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
+#include "message.hpp"
+#include "task.hpp"
 
 Console::Console(const PixelColor& fg_color, const PixelColor& bg_color)
     :  fg_color_{fg_color}, bg_color_{bg_color}, buffer_{},
@@ -11,19 +13,24 @@ Console::Console(const PixelColor& fg_color, const PixelColor& bg_color)
 {}
 
 void Console::PutString(const char* s) {
-    while (*s) {
-        if (*s == '\n') {
-            cursor_column_ = 0;
-            Newline();
-        } else if (cursor_column_ < kColumns - 1) {
-            WriteAscii(*writer_, Vector2D<int>{PIXEL_WIDTH_PER_CHAR * cursor_column_, PIXEL_HEIGHT_PER_CHAR * cursor_row_}, *s, fg_color_);
-            buffer_[cursor_row_][cursor_column_] = *s;
-            ++cursor_column_;
+    {
+        SpinLockGuard guard{lock_};
+        while (*s) {
+            if (*s == '\n') {
+                cursor_column_ = 0;
+                Newline();
+            } else if (cursor_column_ < kColumns - 1) {
+                WriteAscii(*writer_, Vector2D<int>{PIXEL_WIDTH_PER_CHAR * cursor_column_, PIXEL_HEIGHT_PER_CHAR * cursor_row_}, *s, fg_color_);
+                buffer_[cursor_row_][cursor_column_] = *s;
+                ++cursor_column_;
+            }
+            ++s;
         }
-        ++s;
     }
 
-    if (layer_manager) layer_manager->Draw(layer_id_);
+    // The caller may hold the layer lock, or be an interrupt handler that
+    // interrupted its holder, so the layer is drawn by the draw task
+    RequestDraw();
 }
 
 void Console::SetWriter(PixelWriter* writer) {
@@ -42,6 +49,30 @@ void Console::SetWindow(const std::shared_ptr<Window>& window) {
 void Console::SetLayerID(unsigned int layer_id) { layer_id_ = layer_id; }
 unsigned int Console::LayerID() const { return layer_id_; }
 
+void Console::SetDrawTask(uint64_t task_id) {
+    __atomic_store_n(&draw_task_id_, task_id, __ATOMIC_RELEASE);
+    RequestDraw();
+}
+
+void Console::Draw() {
+    // Text put from now on needs another draw
+    __atomic_store_n(&draw_requested_, false, __ATOMIC_RELEASE);
+    if (layer_manager) layer_manager->Draw(layer_id_);
+}
+
+void Console::RequestDraw() {
+    const uint64_t task_id = __atomic_load_n(&draw_task_id_, __ATOMIC_ACQUIRE);
+    if (task_id == 0 || __atomic_exchange_n(&draw_requested_, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    Message msg{Message::kConsoleDraw};
+    if (task_manager->SendMessage(task_id, msg)) {
+        // The next PutString asks again
+        __atomic_store_n(&draw_requested_, false, __ATOMIC_RELEASE);
+    }
+}
+
 void Console::Newline() {
     if (cursor_row_ < kRows - 1) {
         ++cursor_row_;
@@ -83,4 +114,24 @@ namespace {
 void InitializeConsole() {
     console = new(console_buf) Console{kDesktopFGColor, kDesktopBGColor};
     console->SetWriter(screen_writer);
-}
\ No newline at end of file
+}
+
+namespace {
+    int emergency_row = 0;
+}
+
+void EmergencyPrint(const char* s) {
+    while (*s) {
+        // Processors faulting at once take different rows
+        const int row = __atomic_fetch_add(&emergency_row, 1, __ATOMIC_RELAXED) % Console::kRows;
+        const int y = PIXEL_HEIGHT_PER_CHAR * row;
+        FillRectangle(*screen_writer, {0, y},
+                      {PIXEL_WIDTH_PER_CHAR * Console::kColumns, PIXEL_HEIGHT_PER_CHAR}, kDesktopBGColor);
+        for (int column = 0; *s && *s != '\n'; ++s, ++column) {
+            if (column < Console::kColumns) {
+                WriteAscii(*screen_writer, Vector2D<int>{PIXEL_WIDTH_PER_CHAR * column, y}, *s, kDesktopFGColor);
+            }
+        }
+        if (*s == '\n') ++s;
+    }
+}
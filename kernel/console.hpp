@@ -2,6 +2,7 @@
 
 #include <memory>
 #include "graphics.hpp"
+#include "spinlock.hpp"
 #include "window.hpp"
 
 class Console {
@@ -14,9 +15,15 @@ public:
     void SetWindow(const std::shared_ptr<Window>& window);
     void SetLayerID(unsigned int layer_id);
     unsigned int LayerID() const;
+    // The task redraws the console layer when it receives kConsoleDraw.
+    // Until it is set, PutString only writes the window.
+    void SetDrawTask(uint64_t task_id);
+    // Called by the draw task
+    void Draw();
 private:
     void Newline();
     void Refresh();
+    void RequestDraw();
 
     PixelWriter* writer_;
     std::shared_ptr<Window> window_;
@@ -24,8 +31,20 @@ private:
     char buffer_[kRows][kColumns + 1];
     int cursor_row_, cursor_column_;
     unsigned int layer_id_;
+    // Serializes PutString of tasks on different processors
+    SpinLock lock_;
+    uint64_t draw_task_id_{0};
+    // Set while a kConsoleDraw message is queued for the draw task
+    bool draw_requested_{false};
 };
 
 extern Console* console;
 
 void InitializeConsole();
+
+/**
+ * Write lines straight to the frame buffer, from the top of the screen,
+ * without taking any lock. For fault handlers, which may have interrupted
+ * a holder of the console or layer lock. Redrawn layers may cover the text.
+ */
+void EmergencyPrint(const char* s);
@@ -25,6 +25,7 @@ public:
         kNoPCIMSI,
         kUnknownPixelFormat,
         kNoSuchTask,
+        kAlreadyFreed,
         kLastOfCode,
     };
 private:
@@ -48,6 +49,7 @@ private:
         "kNoPCIMSI",
         "kUnknownPixelFormat",
         "kNoSuchTask",
+        "kAlreadyFreed",
     };
     static_assert(Error::Code::kLastOfCode == code_names_.size());
 public:
@@ -57,6 +59,10 @@ public:
         return this->code_ != kSuccess;
     }
 
+    Code Cause() const {
+        return this->code_;
+    }
+
     const char* Name() const {
         return code_names_[static_cast<int>(this->code_)];
     }
@@ -0,0 +1,57 @@
+#include "fpu.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "smp.hpp"
+
+int fpu_save_mode = kFPUSaveFXSave;
+FPUOwner fpu_owners[kMaxCPUs];
+
+namespace {
+    const uint32_t kCPUIDXSAVE = 1u << 26; // CPUID.01H:ECX
+    const uint32_t kCPUIDXSAVEOPT = 1u << 0; // CPUID.(EAX=0DH,ECX=1):EAX
+    const uint64_t kCR0MP = 1ul << 1;
+    const uint64_t kCR0EM = 1ul << 2;
+    const uint64_t kCR0TS = 1ul << 3;
+    const uint64_t kCR4OSXSAVE = 1ul << 18;
+    const uint64_t kXCR0X87 = 1ul << 0;
+    const uint64_t kXCR0SSE = 1ul << 1;
+
+    int DetectSaveMode() {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        if ((ecx & kCPUIDXSAVE) == 0) return kFPUSaveFXSave;
+
+        CPUID(0xd, 1, &eax, &ebx, &ecx, &edx);
+        return (eax & kCPUIDXSAVEOPT) ? kFPUSaveXSaveOpt : kFPUSaveXSave;
+    }
+}
+
+void InitializeFPU() {
+    // #NM on x87 and SSE instructions while CR0.TS is set
+    SetCR0((GetCR0() | kCR0MP) & ~(kCR0EM | kCR0TS));
+
+    const int mode = DetectSaveMode();
+    if (mode != kFPUSaveFXSave) {
+        SetCR4(GetCR4() | kCR4OSXSAVE);
+        // The kernel is built without AVX, so x87 and SSE are all it needs
+        SetXCR0(kXCR0X87 | kXCR0SSE);
+    }
+
+    if (CurrentCPUIndex() == 0) {
+        fpu_save_mode = mode;
+        Log(kInfo, "FPU state is saved with %s\n",
+            mode == kFPUSaveXSaveOpt ? "XSAVEOPT" : mode == kFPUSaveXSave ? "XSAVE" : "FXSAVE");
+    }
+}
+
+void InitFPUArea(void* area) {
+    auto bytes = reinterpret_cast<uint8_t*>(area);
+    // A zero XSAVE header makes XRSTOR load the initial state. FXRSTOR reads
+    // the control words, so they are set to their initial values too.
+    memset(bytes, 0, kFPUAreaBytes);
+    *reinterpret_cast<uint16_t*>(&bytes[0]) = 0x037f; // FCW
+    *reinterpret_cast<uint32_t*>(&bytes[24]) = 0x1f80; // MXCSR
+}
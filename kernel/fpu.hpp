@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "smp.hpp"
+
+/**
+ * Bytes of a task's FPU save area: the 512-byte FXSAVE image followed by
+ * the 64-byte XSAVE header. Only the x87 and SSE state are enabled in XCR0,
+ * so XSAVE needs no more. Areas must be 64-byte aligned.
+ */
+const size_t kFPUAreaBytes = 576;
+
+// How IntHandlerDeviceNotAvailable saves and restores the registers
+const int kFPUSaveFXSave = 0;
+const int kFPUSaveXSave = 1;
+const int kFPUSaveXSaveOpt = 2;
+extern "C" int fpu_save_mode;
+
+/**
+ * Save areas for the FPU registers of a processor. owner_area belongs to
+ * the task whose state is in the registers and current_area to the task
+ * running, which the scheduler sets on every task switch. The #NM handler
+ * saves the registers to owner_area and loads current_area without
+ * calling compiled code, which may use the SSE registers, and only then
+ * stores current_area to owner_area.
+ */
+struct FPUOwner {
+    void* owner_area;
+    void* current_area;
+};
+static_assert(sizeof(FPUOwner) == 16, "the #NM handler indexes fpu_owners by shifting");
+// Indexed by CPU index
+extern "C" FPUOwner fpu_owners[kMaxCPUs];
+
+// Sets up FXSAVE or XSAVE on the calling processor. Every processor calls it.
+void InitializeFPU();
+// Writes the state of a task which has not used the FPU yet
+void InitFPUArea(void* area);
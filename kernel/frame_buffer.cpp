@@ -1,5 +1,7 @@
 #include "frame_buffer.hpp"
 
+#include <emmintrin.h>
+
 namespace {
 
 int BytesPerPixel(PixelFormat format) {
@@ -18,6 +20,23 @@ int BytesPerScanLine(const FrameBufferConfig& config) {
     return BytesPerPixel(config.pixel_format) * config.pixels_per_scan_line;
 }
 
+// Copies with non-temporal stores, which go straight to write-combining
+// buffers instead of reading the destination into the cache.
+// bytes must be a multiple of 4 and dst 4-byte aligned.
+void StreamCopy(uint8_t* dst, const uint8_t* src, size_t bytes) {
+    while (bytes >= 4 && reinterpret_cast<uintptr_t>(dst) % 16 != 0) {
+        _mm_stream_si32(reinterpret_cast<int*>(dst), *reinterpret_cast<const int*>(src));
+        dst += 4; src += 4; bytes -= 4;
+    }
+    for (; bytes >= 16; dst += 16, src += 16, bytes -= 16) {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+    }
+    for (; bytes >= 4; dst += 4, src += 4, bytes -= 4) {
+        _mm_stream_si32(reinterpret_cast<int*>(dst), *reinterpret_cast<const int*>(src));
+    }
+}
+
 Vector2D<int> FrameBufferSize(const FrameBufferConfig& config) {
     return {
         static_cast<int>(config.horizontal_resolution),
@@ -34,11 +53,12 @@ Error FrameBuffer::Initialize(const FrameBufferConfig& config) {
     if (bytes_per_pixel <= 0) return MAKE_ERROR(Error::kUnknownPixelFormat);
 
     if (config_.frame_buffer) {
-        buffer_.resize(0);
+        buffer_.reset();
     } else {
         auto buf_size = bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution;
-        buffer_.resize(buf_size);
-        config_.frame_buffer = buffer_.data();
+        buffer_.reset(static_cast<uint8_t*>(calloc(buf_size, 1)));
+        if (!buffer_) return MAKE_ERROR(Error::kNoEnoughMemory);
+        config_.frame_buffer = buffer_.get();
         config_.pixels_per_scan_line = config_.horizontal_resolution;
     }
 
@@ -73,11 +93,21 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rec
     uint8_t* dst_buf = FrameAddrAt(copy_area.pos, config_);
     const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
 
+    // The screen is mapped write-combining. Shadow buffers are ordinary memory
+    const bool to_screen = !buffer_;
     for (int y = 0; y < copy_area.size.y; ++y) {
-        memcpy(dst_buf, src_buf, bytes_per_pixel * (copy_area.size.x));
+        if (to_screen) {
+            StreamCopy(dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
+        } else {
+            memcpy(dst_buf, src_buf, bytes_per_pixel * (copy_area.size.x));
+        }
         dst_buf += BytesPerScanLine(config_);
         src_buf += BytesPerScanLine(src.config_);
     }
+    if (to_screen) {
+        // Makes the streaming stores visible before anything else touches the screen
+        _mm_sfence();
+    }
 
     return MAKE_ERROR(Error::kSuccess);
 }
@@ -1,7 +1,7 @@
 #pragma once
 
+#include <cstdlib>
 #include <memory>
-#include <vector>
 
 #include "error.hpp"
 #include "frame_buffer_config.hpp"
@@ -16,7 +16,13 @@ public:
     FrameBufferWriter& Writer() { return *writer_; }
     const FrameBufferConfig& Config() const { return config_; }
 private:
+    struct FreeDeleter {
+        void operator()(uint8_t* p) const { free(p); }
+    };
+
     FrameBufferConfig config_{};
-    std::vector<uint8_t> buffer_{};
+    // Taken with calloc, whose fresh pages from sbrk are mapped on first
+    // touch with frames from the zeroed pool and are not cleared again
+    std::unique_ptr<uint8_t[], FreeDeleter> buffer_{};
     std::unique_ptr<FrameBufferWriter> writer_{};
 };
@@ -0,0 +1,314 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sys/types.h>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+
+namespace {
+
+// Placed right before every block handed out by AllocHeap
+struct BlockHeader {
+    uint32_t magic;
+    uint32_t size_class;
+    uint64_t num_frames;
+};
+static_assert(sizeof(BlockHeader) == 16);
+
+// Link of a free small block, overlapping its header
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+const uint32_t kBlockMagic = 0x4b484541; // "KHEA"
+
+// Bytes of a small block including its header. Larger requests take frames
+// directly from the memory manager.
+constexpr std::array<size_t, 7> kSizeClassBytes{32, 64, 128, 256, 512, 1024, 2048};
+const uint32_t kLargeClass = kSizeClassBytes.size();
+// Header put right before an over-aligned pointer. num_frames holds the
+// offset from the header of the block containing it.
+const uint32_t kAlignedClass = kLargeClass + 1;
+const size_t kFramesPerRefill = 4;
+
+// Guards the free lists, the sbrk region and the counters below
+SpinLock heap_lock;
+std::array<FreeBlock*, kSizeClassBytes.size()> free_lists{};
+
+// newlib's malloc grows the region below the program break with sbrk.
+// It lives in the higher half and frames are mapped when a page is touched.
+const uintptr_t kSbrkRegionBase = 0xffff800000000000;
+// The region reserved by sbrk grows in chunks of this size
+const size_t kSbrkChunkBytes = 64 * 4096;
+uintptr_t program_break = kSbrkRegionBase;
+uintptr_t sbrk_region_end = kSbrkRegionBase;
+
+size_t heap_limit_bytes = kDefaultHeapLimitBytes;
+// Bytes of the sbrk region which may be mapped, plus frames held by AllocHeap
+size_t committed_bytes = 0;
+size_t growth_events = 0;
+// Bytes of blocks handed out by AllocHeap, including headers
+size_t in_use_bytes = 0;
+size_t high_water_bytes = 0;
+
+void AddInUse(size_t bytes) {
+    in_use_bytes += bytes;
+    high_water_bytes = std::max(high_water_bytes, in_use_bytes);
+}
+
+WithError<FrameID> TakeFrames(size_t num_frames) {
+    if (committed_bytes + num_frames * kBytesPerFrame > heap_limit_bytes) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    const auto frame = memory_manager->Allocate(num_frames);
+    if (frame.error) return frame;
+
+    committed_bytes += num_frames * kBytesPerFrame;
+    ++growth_events;
+    return frame;
+}
+
+void ReturnFrames(FrameID frame, size_t num_frames) {
+    memory_manager->Free(frame, num_frames);
+    committed_bytes -= num_frames * kBytesPerFrame;
+}
+
+uint32_t SizeClass(size_t bytes) {
+    for (uint32_t i = 0; i < kSizeClassBytes.size(); ++i) {
+        if (bytes <= kSizeClassBytes[i]) return i;
+    }
+    return kLargeClass;
+}
+
+bool Refill(uint32_t size_class) {
+    const auto frame = TakeFrames(kFramesPerRefill);
+    if (frame.error) return false;
+
+    const auto block_bytes = kSizeClassBytes[size_class];
+    auto p = reinterpret_cast<uintptr_t>(frame.value.Frame());
+    const auto end = p + kFramesPerRefill * kBytesPerFrame;
+    for (; p + block_bytes <= end; p += block_bytes) {
+        auto block = reinterpret_cast<FreeBlock*>(p);
+        block->next = free_lists[size_class];
+        free_lists[size_class] = block;
+    }
+    return true;
+}
+
+BlockHeader* AllocBlock(size_t bytes) {
+    const auto size_class = SizeClass(bytes);
+    if (size_class == kLargeClass) {
+        const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+        const auto frame = TakeFrames(num_frames);
+        if (frame.error) return nullptr;
+
+        auto header = reinterpret_cast<BlockHeader*>(frame.value.Frame());
+        header->size_class = kLargeClass;
+        header->num_frames = num_frames;
+        AddInUse(num_frames * kBytesPerFrame);
+        return header;
+    }
+
+    if (free_lists[size_class] == nullptr && !Refill(size_class)) {
+        return nullptr;
+    }
+
+    auto block = free_lists[size_class];
+    free_lists[size_class] = block->next;
+
+    auto header = reinterpret_cast<BlockHeader*>(block);
+    header->size_class = size_class;
+    header->num_frames = 0;
+    AddInUse(kSizeClassBytes[size_class]);
+    return header;
+}
+
+void ReleaseBlock(BlockHeader* header) {
+    header->magic = 0;
+    if (header->size_class == kLargeClass) {
+        in_use_bytes -= header->num_frames * kBytesPerFrame;
+        ReturnFrames(
+            FrameID{reinterpret_cast<uintptr_t>(header) / kBytesPerFrame}, header->num_frames);
+        return;
+    }
+
+    const auto size_class = header->size_class;
+    in_use_bytes -= kSizeClassBytes[size_class];
+    auto block = reinterpret_cast<FreeBlock*>(header);
+    block->next = free_lists[size_class];
+    free_lists[size_class] = block;
+}
+
+}
+
+// The heap is used from interrupt handlers and other processors too, so
+// lists are updated under heap_lock with interrupts masked
+void* AllocHeap(size_t size, size_t alignment) {
+    SpinLockGuard guard{heap_lock};
+    if (alignment <= kHeapMinAlignment) {
+        auto header = AllocBlock(size + sizeof(BlockHeader));
+        if (header == nullptr) return nullptr;
+        header->magic = kBlockMagic;
+        return header + 1;
+    }
+
+    // Blocks are 16-byte aligned, so shifting the payload by at most
+    // alignment - 16 bytes reaches an aligned address.
+    auto header = AllocBlock(size + alignment);
+    if (header == nullptr) return nullptr;
+    header->magic = kBlockMagic;
+
+    const auto payload = reinterpret_cast<uintptr_t>(header + 1);
+    const auto aligned = (payload + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+    if (aligned == payload) return header + 1;
+
+    auto aligned_header = reinterpret_cast<BlockHeader*>(aligned) - 1;
+    aligned_header->magic = kBlockMagic;
+    aligned_header->size_class = kAlignedClass;
+    aligned_header->num_frames = aligned - reinterpret_cast<uintptr_t>(header);
+    return reinterpret_cast<void*>(aligned);
+}
+
+void FreeHeap(void* p) {
+    if (p == nullptr) return;
+
+    auto header = reinterpret_cast<BlockHeader*>(p) - 1;
+    if (header->magic == kBlockMagic && header->size_class == kAlignedClass) {
+        header->magic = 0;
+        header = reinterpret_cast<BlockHeader*>(reinterpret_cast<uintptr_t>(p) - header->num_frames);
+    }
+    if (header->magic != kBlockMagic) {
+        Log(kError, "FreeHeap: invalid pointer %p\n", p);
+        return;
+    }
+
+    SpinLockGuard guard{heap_lock};
+    ReleaseBlock(header);
+}
+
+void SetHeapLimit(size_t bytes) {
+    SpinLockGuard guard{heap_lock};
+    heap_limit_bytes = bytes;
+}
+
+HeapStats GetHeapStats() {
+    SpinLockGuard guard{heap_lock};
+    return {heap_limit_bytes, committed_bytes, growth_events, in_use_bytes, high_water_bytes};
+}
+
+extern "C" caddr_t sbrk(int incr) {
+    SpinLockGuard guard{heap_lock};
+    const auto prev_break = program_break;
+    const auto new_break = program_break + incr;
+    if (new_break < kSbrkRegionBase) {
+        errno = EINVAL;
+        return reinterpret_cast<caddr_t>(-1);
+    }
+
+    if (new_break > sbrk_region_end) {
+        // Reserve whole chunks. Frames are mapped by HandleHeapPageFault.
+        const auto chunks = (new_break - sbrk_region_end + kSbrkChunkBytes - 1) / kSbrkChunkBytes;
+        const auto grow_bytes = chunks * kSbrkChunkBytes;
+        if (committed_bytes + grow_bytes > heap_limit_bytes) {
+            errno = ENOMEM;
+            return reinterpret_cast<caddr_t>(-1);
+        }
+        sbrk_region_end += grow_bytes;
+        committed_bytes += grow_bytes;
+        ++growth_events;
+    }
+
+    program_break = new_break;
+    return reinterpret_cast<caddr_t>(prev_break);
+}
+
+namespace {
+
+// newlib's malloc takes its lock again from realloc and memalign, so the
+// lock is recursive on the processor holding it
+SpinLock malloc_lock;
+int malloc_lock_owner = -1;
+int malloc_lock_depth = 0;
+uint64_t malloc_lock_rflags;
+
+}
+
+extern "C" void __malloc_lock(struct _reent*) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+    // Interrupts are masked, so only this processor can make the owner its own
+    const int cpu = CurrentCPUIndex();
+    if (__atomic_load_n(&malloc_lock_owner, __ATOMIC_RELAXED) != cpu) {
+        malloc_lock.Lock();
+        malloc_lock_owner = cpu;
+        malloc_lock_rflags = rflags;
+    }
+    ++malloc_lock_depth;
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+    if (--malloc_lock_depth > 0) return;
+
+    const auto rflags = malloc_lock_rflags;
+    __atomic_store_n(&malloc_lock_owner, -1, __ATOMIC_RELAXED);
+    malloc_lock.Unlock();
+    if (rflags & 0x200) __asm__ volatile("sti" : : : "memory");
+}
+
+Error HandleHeapPageFault(uint64_t error_code, uint64_t causal_addr) {
+    // Only faults on non-present pages in the reserved sbrk region are handled
+    if ((error_code & 1) || causal_addr < kSbrkRegionBase || sbrk_region_end <= causal_addr) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // Like memory from sbrk on other systems, new pages read as zeros
+    const auto frame = memory_manager->Allocate(1, true);
+    if (frame.error) return frame.error;
+    // The page was not present, so there is no TLB entry to invalidate
+    auto err = kernel_page_map->Map(causal_addr, reinterpret_cast<uint64_t>(frame.value.Frame()),
+                                    kBytesPerFrame, kPageWritable);
+    if (err.Cause() == Error::kAlreadyAllocated) {
+        // Another processor faulted on the same page and mapped it first
+        memory_manager->Free(frame.value, 1);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    return err;
+}
+
+namespace {
+
+void* NewOrDie(size_t size, size_t alignment = kHeapMinAlignment) {
+    if (auto p = AllocHeap(size, alignment)) return p;
+    Log(kError, "failed to allocate %lu bytes aligned to %lu from the kernel heap\n", size, alignment);
+    exit(1);
+}
+
+}
+
+void* operator new(size_t size) { return NewOrDie(size); }
+void* operator new[](size_t size) { return NewOrDie(size); }
+void operator delete(void* p) noexcept { FreeHeap(p); }
+void operator delete[](void* p) noexcept { FreeHeap(p); }
+void operator delete(void* p, size_t) noexcept { FreeHeap(p); }
+void operator delete[](void* p, size_t) noexcept { FreeHeap(p); }
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return NewOrDie(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return NewOrDie(size, static_cast<size_t>(alignment));
+}
+void operator delete(void* p, std::align_val_t) noexcept { FreeHeap(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { FreeHeap(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { FreeHeap(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { FreeHeap(p); }
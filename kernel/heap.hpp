@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+const size_t kHeapMinAlignment = 16;
+
+/**
+ * Allocate size bytes from the kernel heap and returns a pointer of them.
+ * alignment must be a power of two (e.g. 64 for cache lines or 4096 for pages).
+ * Returns nullptr when no memory is left.
+ */
+void* AllocHeap(size_t size, size_t alignment = kHeapMinAlignment);
+
+/**
+ * Return memory allocated by AllocHeap to the kernel heap.
+ */
+void FreeHeap(void* p);
+
+struct HeapStats {
+    // Upper limit of memory committed to the heap
+    size_t limit_bytes;
+    // Frames taken from the memory manager, including lazily mapped sbrk pages
+    size_t committed_bytes;
+    // Number of times the heap asked the memory manager for more frames
+    size_t growth_events;
+    // Bytes of blocks currently allocated by AllocHeap and their peak
+    size_t in_use_bytes;
+    size_t high_water_bytes;
+};
+
+const size_t kDefaultHeapLimitBytes = 1024 * 1024 * 1024;
+
+/**
+ * Set the upper limit of memory committed to the heap. Memory already
+ * committed is not released when the limit becomes lower.
+ */
+void SetHeapLimit(size_t bytes);
+HeapStats GetHeapStats();
+
+/**
+ * Map a frame for a page of the sbrk region touched for the first time.
+ * Returns an error when the address is not a lazily mapped heap address.
+ */
+Error HandleHeapPageFault(uint64_t error_code, uint64_t causal_addr);
@@ -0,0 +1,121 @@
+#include "hpet.hpp"
+
+#include "acpi.hpp"
+#include "logger.hpp"
+#include "paging.hpp"
+
+namespace {
+
+const uint64_t kFemtosecondsPerSecond = 1000000000000000ul;
+
+// Registers, as offsets from the base address
+const uint64_t kCapabilities = 0x000;
+const uint64_t kConfiguration = 0x010;
+const uint64_t kMainCounter = 0x0f0;
+uint64_t TimerConfiguration(int n) { return 0x100 + 0x20 * n; }
+uint64_t TimerComparator(int n) { return 0x108 + 0x20 * n; }
+uint64_t TimerFSBRoute(int n) { return 0x110 + 0x20 * n; }
+
+const uint64_t kCapCounter64Bit = 1u << 13;
+const uint64_t kConfEnable = 1u << 0;
+const uint64_t kConfLegacyRoute = 1u << 1;
+const uint64_t kTimerInterruptEnable = 1u << 2;
+const uint64_t kTimerPeriodic = 1u << 3;
+const uint64_t kTimer32BitMode = 1u << 8;
+const uint64_t kTimerFSBEnable = 1u << 14;
+const uint64_t kTimerFSBCapable = 1u << 15;
+
+uintptr_t hpet_base = 0;
+uint64_t hpet_freq;
+bool counter_64bit;
+int num_timers;
+int one_shot_timer = -1;
+
+volatile uint64_t& Register(uint64_t offset) {
+    return *reinterpret_cast<volatile uint64_t*>(hpet_base + offset);
+}
+
+}
+
+bool InitializeHPET() {
+    if (acpi::hpet == nullptr || acpi::hpet->address_space_id != 0) { // 0: system memory
+        Log(kInfo, "no HPET\n");
+        return false;
+    }
+
+    const uint64_t base = acpi::hpet->base_address;
+    if (auto err = MapIdentity(base, 1024)) {
+        Log(kWarn, "failed to map HPET registers: %s\n", err.Name());
+        return false;
+    }
+    hpet_base = base;
+
+    const uint64_t cap = Register(kCapabilities);
+    const uint64_t period_fs = cap >> 32;
+    if (period_fs == 0 || period_fs > 100000000) { // The spec allows up to 100 ns
+        Log(kWarn, "HPET has an invalid period %lu fs\n", period_fs);
+        hpet_base = 0;
+        return false;
+    }
+    hpet_freq = kFemtosecondsPerSecond / period_fs;
+    counter_64bit = cap & kCapCounter64Bit;
+    num_timers = ((cap >> 8) & 0x1f) + 1;
+
+    for (int n = 0; n < num_timers; ++n) {
+        Register(TimerConfiguration(n)) &= ~(kTimerInterruptEnable | kTimerFSBEnable);
+    }
+    Register(kConfiguration) = (Register(kConfiguration) & ~kConfLegacyRoute) | kConfEnable;
+
+    Log(kInfo, "HPET: %lu kHz, %d-bit counter, %d timers\n",
+        hpet_freq / 1000, counter_64bit ? 64 : 32, num_timers);
+    return true;
+}
+
+bool HPETAvailable() {
+    return hpet_base != 0;
+}
+
+uint64_t HPETFrequency() {
+    return hpet_freq;
+}
+
+uint64_t HPETCounter() {
+    const uint64_t count = Register(kMainCounter);
+    return counter_64bit ? count : count & 0xffffffffu;
+}
+
+bool HPETCounter64Bit() {
+    return counter_64bit;
+}
+
+uint64_t HPETElapsed(uint64_t start, uint64_t end) {
+    return counter_64bit ? end - start : (end - start) & 0xffffffffu;
+}
+
+bool InitializeHPETOneShot(uint8_t apic_id, uint8_t vector) {
+    if (!HPETAvailable() || !counter_64bit) {
+        return false;
+    }
+
+    for (int n = 0; n < num_timers; ++n) {
+        const uint64_t conf = Register(TimerConfiguration(n));
+        if ((conf & kTimerFSBCapable) == 0) {
+            continue;
+        }
+
+        // The upper half is the message address and the lower half the data
+        const uint64_t msi_addr = 0xfee00000u | static_cast<uint64_t>(apic_id) << 12;
+        Register(TimerFSBRoute(n)) = msi_addr << 32 | vector;
+        Register(TimerConfiguration(n)) =
+            (conf & ~(kTimerPeriodic | kTimer32BitMode)) | kTimerFSBEnable | kTimerInterruptEnable;
+        one_shot_timer = n;
+        return true;
+    }
+    return false;
+}
+
+bool HPETArmOneShot(uint64_t counter_value) {
+    Register(TimerComparator(one_shot_timer)) = counter_value;
+    // The comparator only matches when the counter passes the value
+    return HPETCounter() < counter_value;
+}
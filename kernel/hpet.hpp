@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Start the main counter of the HPET described by the ACPI HPET table.
+ * Returns false when there is none. ACPI must be initialized.
+ */
+bool InitializeHPET();
+
+bool HPETAvailable();
+// Frequency of the main counter in Hz
+uint64_t HPETFrequency();
+// Value of the main counter, which wraps at 32 bits unless HPETCounter64Bit
+uint64_t HPETCounter();
+bool HPETCounter64Bit();
+// Counts of the main counter from start to end, which may have wrapped once
+uint64_t HPETElapsed(uint64_t start, uint64_t end);
+
+/**
+ * Set up a comparator which delivers vector to the local APIC apic_id by
+ * FSB (MSI) messages, for use as a one-shot event source. Returns false
+ * when the HPET has no 64-bit counter or no comparator supports FSB delivery.
+ */
+bool InitializeHPETOneShot(uint8_t apic_id, uint8_t vector);
+// Requests an interrupt when the main counter reaches counter_value.
+// Returns false if the counter has already passed it, when no interrupt comes.
+bool HPETArmOneShot(uint64_t counter_value);
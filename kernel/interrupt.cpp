@@ -1,7 +1,9 @@
 #include "asmfunc.h"
+#include "heap.hpp"
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "segment.hpp"
+#include "stack.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
@@ -27,12 +29,39 @@ void NotifyEndOfInterrupt() {
 
 namespace {
 
+    __attribute__((interrupt))
+    void IntHandlerPageFault(InterruptFrame* frame, uint64_t error_code) {
+        const uint64_t causal_addr = GetCR2();
+        if ((error_code & 1) == 0 && IsStackGuardAddress(causal_addr)) {
+            EmergencyLog("#PF: stack overflow in task %lu: addr = %016lx, rip = %016lx\n",
+                         task_manager->CurrentTaskUnlocked().ID(), causal_addr, frame->rip);
+            while (true) __asm__("hlt");
+        }
+        if (auto err = HandleHeapPageFault(error_code, causal_addr)) {
+            EmergencyLog("#PF: addr = %016lx, error_code = %lx, rip = %016lx: %s\n",
+                         causal_addr, error_code, frame->rip, err.Name());
+            while (true) __asm__("hlt");
+        }
+    }
+
+    __attribute__((interrupt))
+    void IntHandlerDoubleFault(InterruptFrame* frame, uint64_t error_code) {
+        EmergencyLog("#DF: rip = %016lx, rsp = %016lx\n", frame->rip, frame->rsp);
+        while (true) __asm__("hlt");
+    }
+
     __attribute__((interrupt))
     void IntHandlerXHCI(InterruptFrame* frame) {
         Log(kDebug, "Interrupt happened\n");
         task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
         NotifyEndOfInterrupt();
     }
+
+    __attribute__((interrupt))
+    void IntHandlerReschedule(InterruptFrame* frame) {
+        NotifyEndOfInterrupt();
+        PreemptFromInterrupt();
+    }
 }
 
 __attribute__((interrupt))
@@ -41,10 +70,20 @@ void IntHandlerLAPICTimer(InterruptFrame* frame) {
 }
 
 void InitializeInterrupt() {
+    SetIDTEntry(idt[InterruptVector::kDeviceNotAvailable], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable), kKernelCS);
+    SetIDTEntry(idt[InterruptVector::kDoubleFault],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForFault),
+                reinterpret_cast<uint64_t>(IntHandlerDoubleFault), kKernelCS);
+    SetIDTEntry(idt[InterruptVector::kPageFault],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForFault),
+                reinterpret_cast<uint64_t>(IntHandlerPageFault), kKernelCS);
     SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
                 reinterpret_cast<uint64_t>(IntHandlerXHCI), kKernelCS);
     SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
                 reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),kKernelCS);
+    SetIDTEntry(idt[InterruptVector::kReschedule], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerReschedule), kKernelCS);
 
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
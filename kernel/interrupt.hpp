@@ -49,8 +49,12 @@ void SetIDTEntry(
 class InterruptVector {
 public:
     enum Number {
+        kDeviceNotAvailable = 7,
+        kDoubleFault = 8,
+        kPageFault = 14,
         kXHCI = 0x40,
         kLAPICTimer = 0x41,
+        kReschedule = 0x42,
     };
 };
 
@@ -64,4 +68,19 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+// Masks interrupts during its lifetime and restores the previous interrupt flag
+class InterruptGuard {
+public:
+    InterruptGuard() {
+        __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags_) : : "memory");
+    }
+    ~InterruptGuard() {
+        if (rflags_ & 0x200) __asm__ volatile("sti" : : : "memory");
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+private:
+    uint64_t rflags_;
+};
+
 void InitializeInterrupt();
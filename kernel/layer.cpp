@@ -2,6 +2,22 @@
 #include "font.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
+#include "slab.hpp"
+#include "task.hpp"
+
+namespace {
+    SlabCache layer_cache{"Layer", sizeof(Layer)};
+}
+
+void* Layer::operator new(size_t size) {
+    if (auto p = layer_cache.Allocate()) return p;
+    Log(kError, "failed to allocate a layer\n");
+    exit(1);
+}
+
+void Layer::operator delete(void* p) {
+    layer_cache.Free(p);
+}
 
 Layer::Layer(unsigned int id) : id_{id} {}
 unsigned int Layer::ID() const { return id_; }
@@ -42,18 +58,30 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
 }
 
 Layer& LayerManager::NewLayer() {
-    ++latest_id_;
-    return *layers_.emplace_back(new Layer{latest_id_});
+    // Allocated without lock_, since a failed allocation logs to the console
+    auto layer = new Layer{__atomic_add_fetch(&latest_id_, 1, __ATOMIC_RELAXED)};
+    TaskSpinLockGuard guard{lock_};
+    return *layers_.emplace_back(layer);
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const {
+    TaskSpinLockGuard guard{lock_};
+    DrawArea(area);
+}
+
+void LayerManager::Draw(unsigned int id) const {
+    TaskSpinLockGuard guard{lock_};
+    DrawLayer(id);
+}
+
+void LayerManager::DrawArea(const Rectangle<int>& area) const {
     for (auto layer : layer_stack_) {
         layer->DrawTo(back_buffer_, area);
     }
     screen_->Copy(area.pos, back_buffer_, area);
 }
 
-void LayerManager::Draw(unsigned int id) const {
+void LayerManager::DrawLayer(unsigned int id) const {
     bool draw = false;
     Rectangle<int> window_area;
     for (auto layer : layer_stack_) {
@@ -68,23 +96,25 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
+    TaskSpinLockGuard guard{lock_};
     auto layer = FindLayer(id);
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
 
     layer->Move(new_pos);
-    Draw({old_pos, window_size});
-    Draw(id);
+    DrawArea({old_pos, window_size});
+    DrawLayer(id);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
+    TaskSpinLockGuard guard{lock_};
     auto layer = FindLayer(id);
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
 
     FindLayer(id)->MoveRelative(pos_diff);
-    Draw({old_pos, window_size});
-    Draw(id);
+    DrawArea({old_pos, window_size});
+    DrawLayer(id);
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
@@ -93,6 +123,7 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
         return;
     }
 
+    TaskSpinLockGuard guard{lock_};
     if (new_height > layer_stack_.size()) new_height = layer_stack_.size();
     auto layer = FindLayer(id);
     auto old_pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
@@ -110,12 +141,14 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
 }
 
 void LayerManager::Hide(unsigned int id) {
+    TaskSpinLockGuard guard{lock_};
     auto layer = FindLayer(id);
     auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
     if (pos != layer_stack_.end()) layer_stack_.erase(pos);
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
+    TaskSpinLockGuard guard{lock_};
     auto pred = [pos, exclude_id](Layer* layer) {
         if (layer->ID() == exclude_id) return false;
         const auto& win = layer->GetWindow();
@@ -3,10 +3,15 @@
 #include <memory>
 
 #include "graphics.hpp"
+#include "spinlock.hpp"
 #include "window.hpp"
 
 class Layer {
 public:
+    // Layers are allocated from a dedicated slab cache
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
     Layer(unsigned int id = 0);
     unsigned int ID() const;
 
@@ -27,6 +32,8 @@ private:
     bool draggable_{false};
 };
 
+// Tasks on any processor may draw, so the public methods take a lock. It
+// only disables preemption, so interrupt handlers must not draw.
 class LayerManager {
 public:
     void SetWriter(FrameBuffer* writer);
@@ -48,8 +55,12 @@ private:
     std::vector<std::unique_ptr<Layer>> layers_{};
     std::vector<Layer*> layer_stack_{};
     unsigned int latest_id_{0};
+    mutable SpinLock lock_;
 
     Layer* FindLayer(unsigned int id);
+    // Draw without taking the lock
+    void DrawArea(const Rectangle<int>& area) const;
+    void DrawLayer(unsigned int id) const;
 };
 
 extern LayerManager* layer_manager;
@@ -1,10 +1,22 @@
 #include <new>
 #include <cerrno>
+#include <malloc.h>
 
 std::new_handler std::get_new_handler() noexcept {
   return nullptr;
 }
 
-extern "C" int posix_memalign(void**, size_t, size_t) {
-  return ENOMEM;
+// C callers release the memory with free(), so it has to come from newlib's
+// malloc rather than the kernel heap. Aligned operator new is in heap.cpp.
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+
+  void* p = memalign(alignment, size);
+  if (p == nullptr) {
+    return ENOMEM;
+  }
+  *memptr = p;
+  return 0;
 }
\ No newline at end of file
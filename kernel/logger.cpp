@@ -29,3 +29,16 @@ int Log(LogLevel level, const char* format, ...) {
     console->PutString(s);
     return result;
 }
+
+int EmergencyLog(const char* format, ...) {
+    va_list ap;
+    int result;
+    char s[1024];
+
+    va_start(ap, format);
+    result = vsprintf(s, format, ap);
+    va_end(ap);
+
+    EmergencyPrint(s);
+    return result;
+}
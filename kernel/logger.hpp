@@ -13,6 +13,9 @@ LogLevel GetLogLevel();
 
 // Output a log with specified log level
 int Log(LogLevel level, const char* format, ...);
+// Output a log regardless of the log level without taking any lock, for
+// fault handlers. See EmergencyPrint.
+int EmergencyLog(const char* format, ...);
 
 template<typename Func>
 void DebugLog(Func execute) {
@@ -1,3 +1,4 @@
+#include <array>
 #include <cstdint>
 #include <cstddef>
 #include <cstdio>
@@ -6,10 +7,14 @@
 
 #include "acpi.hpp"
 #include "asmfunc.h"
+#include "clock.hpp"
 #include "console.hpp"
 #include "frame_buffer_config.hpp"
 #include "font.hpp"
+#include "fpu.hpp"
 #include "graphics.hpp"
+#include "heap.hpp"
+#include "hpet.hpp"
 #include "interrupt.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
@@ -20,13 +25,13 @@
 #include "paging.hpp"
 #include "pci.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 #include "timer.hpp"
+#include "usb/memory.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "window.hpp"
 
-void operator delete(void* obj) noexcept {}
-
 int printk(const char* format, ...) {
     va_list ap;
     int result;
@@ -123,6 +128,7 @@ void InitializeTaskBWindow() {
 
 void TaskB(uint64_t task_id, int64_t data) {
     printk("TaskB: task_id=%lu, data=%lx\n", task_id, data);
+    Task& task = task_manager->CurrentTask();
     char str[128];
     int count = 0;
     while (true) {
@@ -131,7 +137,51 @@ void TaskB(uint64_t task_id, int64_t data) {
         FillRectangle(*task_b_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
         WriteString(*task_b_window->Writer(), {24, 28}, str, {0, 0, 0});
         layer_manager->Draw(task_b_window_layer_id);
+        // Redraw once per tick instead of spinning through the timeslice
+        task.SleepFor(1000000000 / kTimerFreq);
+    }
+}
+
+std::shared_ptr<Window> memstat_window;
+unsigned int memstat_window_layer_id;
+const int kMemStatLines = 9;
+void InitializeMemStatWindow() {
+    memstat_window = std::make_shared<Window>(224, 28 + 16 * kMemStatLines, screen_config.pixel_format);
+    DrawWindow(*memstat_window->Writer(), "Memory");
+
+    memstat_window_layer_id = layer_manager->NewLayer()
+        .SetWindow(memstat_window)
+        .SetDraggable(true)
+        .Move({500, 100})
+        .ID();
+
+    layer_manager->UpDown(memstat_window_layer_id, std::numeric_limits<int>::max());
+}
+
+void DrawMemStats() {
+    // Each source takes its own lock, so the figures may be from slightly
+    // different moments
+    const auto mem = memory_manager->GetStats();
+    const auto pool = memory_manager->ZeroedPoolFrames();
+    const auto heap = GetHeapStats();
+    const auto task_bytes = task_manager->MemoryBytes();
+
+    char lines[kMemStatLines][32];
+    sprintf(lines[0], "free  %8lu KiB", mem.free_frames * kBytesPerFrame / 1024);
+    sprintf(lines[1], "used  %8lu KiB", mem.UsedFrames() * kBytesPerFrame / 1024);
+    sprintf(lines[2], "run   %8lu KiB", mem.largest_free_frames * kBytesPerFrame / 1024);
+    sprintf(lines[3], "frag  %8u %%  z%lu", mem.FragmentationIndex(), pool);
+    sprintf(lines[4], "heap  %8lu KiB", heap.in_use_bytes / 1024);
+    sprintf(lines[5], "peak  %8lu KiB", heap.high_water_bytes / 1024);
+    sprintf(lines[6], "usb   %8lu KiB", usb::UsedMemBytes() / 1024);
+    sprintf(lines[7], "win   %8lu KiB", WindowMemoryBytes() / 1024);
+    sprintf(lines[8], "task  %8lu KiB", task_bytes / 1024);
+
+    FillRectangle(*memstat_window->Writer(), {4, 24}, {216, 16 * kMemStatLines}, {0xc6, 0xc6, 0xc6});
+    for (int i = 0; i < kMemStatLines; ++i) {
+        WriteString(*memstat_window->Writer(), {8, 24 + 16 * i}, lines[i], {0, 0, 0});
     }
+    layer_manager->Draw(memstat_window_layer_id);
 }
 
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
@@ -148,10 +198,13 @@ extern "C" void KernelMainNewStack(
     SetLogLevel(kInfo);
 
     InitializeSegmentation();
-    InitializePaging();
     InitializeMemoryManager(memory_map);
+    InitializePaging(memory_map, frame_buffer_config_ref);
+    ReleaseBootServicesMemory(memory_map);
+    InitializeTSS();
 
     InitializeInterrupt();
+    InitializeFPU();
 
     InitializePCI();
 
@@ -159,76 +212,95 @@ extern "C" void KernelMainNewStack(
     InitializeMainWindow();
     InitializeTextWindow();
     InitializeTaskBWindow();
+    InitializeMemStatWindow();
     layer_manager->Draw({{0, 0}, ScreenSize()});
 
     acpi::Initialize(acpi_table);
+    InitializeHPET();
+    InitializeClock();
     InitializeLAPICTimer();
 
+    InitializeTask();
+    Task& main_task = task_manager->CurrentTask();
+    console->SetDrawTask(main_task.ID());
+
     const int kTextboxCursorTimer = 1;
     const int kTimerHalfSec = static_cast<int>(kTimerFreq * 0.5);
-    timer_manager->AddTimer(Timer{kTimerHalfSec, kTextboxCursorTimer});
+    Timer textbox_cursor_timer{kTimerHalfSec, kTextboxCursorTimer, main_task.ID()};
+    timer_manager->AddTimer(textbox_cursor_timer);
     bool textbox_cursor_visible = false;
-
-    InitializeTask();
-    Task& main_task = task_manager->CurrentTask();
+    const int kMemStatTimer = 2;
+    Timer mem_stat_timer{kTimerFreq, kMemStatTimer, main_task.ID()};
+    timer_manager->AddTimer(mem_stat_timer);
+    // TaskB only draws into its own window, so any processor may run it
     const uint64_t taskb_id = task_manager->NewTask()
         .InitContext(TaskB, 45)
+        .SetMigratable(true)
         .Wakeup()
         .ID();
+    InitializeSMP();
 
     usb::xhci::Initialize();
     InitializeKeyboard();
     InitializeMouse();
+    DrawMemStats();
 
     __asm__("sti");
 
     char str[128];
+    // Messages handled per wakeup, after which the screen is updated once
+    std::array<Message, 32> msgs;
 
     while (true) {
-        __asm__("cli");
-        const auto tick =timer_manager->CurrentTick();
-        __asm__("sti");
-
-        sprintf(str, "%010lu", tick);
-        FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
-        WriteString(*main_window->Writer(), {24, 28}, str, {0, 0, 0});
-        layer_manager->Draw(main_window_layer_id);
-
-        __asm__("cli");
-        auto msg = main_task.ReceiveMessage();
-        if (!msg) {
-            main_task.Sleep();
-            __asm__("sti");
+        const size_t num_msgs = main_task.ReceiveMessages(msgs.data(), msgs.size());
+        if (num_msgs == 0) {
+            main_task.SleepUntilMessage();
             continue;
         }
 
-        __asm__("sti");
-
-        switch (msg->type) {
-        case Message::kInterruptXHCI:
-            usb::xhci::ProcessEvents();
-            break;
-        case Message::kTimerTimeout:
-            if (msg->arg.timer.value == kTextboxCursorTimer) {
-                __asm__("cli");
-                timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimerHalfSec, kTextboxCursorTimer});
-                __asm__("sti");
-                textbox_cursor_visible = !textbox_cursor_visible;
-                DrawTextCursor(textbox_cursor_visible);
-                layer_manager->Draw(text_window_layer_id);
-            }
-            break;
-        case Message::kKeyPush:
-            InputTextWindow(msg->arg.keyboard.ascii);
-            if (msg->arg.keyboard.ascii == 's') {
-                printk("sleep TaskB sleep: %s\n", task_manager->Sleep(taskb_id).Name());
-            } else if (msg->arg.keyboard.ascii == 'w') {
-                printk("wakeup TaskB up: %s\n", task_manager->Wakeup(taskb_id).Name());
+        for (size_t i = 0; i < num_msgs; ++i) {
+            const Message& msg = msgs[i];
+            switch (msg.type) {
+            case Message::kInterruptXHCI:
+                usb::xhci::ProcessEvents();
+                break;
+            case Message::kTimerTimeout:
+                if (msg.arg.timer.value == kTextboxCursorTimer) {
+                    textbox_cursor_timer.SetTimeout(msg.arg.timer.timeout + kTimerHalfSec);
+                    timer_manager->AddTimer(textbox_cursor_timer);
+                    textbox_cursor_visible = !textbox_cursor_visible;
+                    DrawTextCursor(textbox_cursor_visible);
+                    layer_manager->Draw(text_window_layer_id);
+                } else if (msg.arg.timer.value == kMemStatTimer) {
+                    mem_stat_timer.SetTimeout(msg.arg.timer.timeout + kTimerFreq);
+                    timer_manager->AddTimer(mem_stat_timer);
+                    DrawMemStats();
+                }
+                break;
+            case Message::kMouseMove:
+                ProcessMouseMessage(msg);
+                break;
+            case Message::kConsoleDraw:
+                console->Draw();
+                break;
+            case Message::kKeyPush:
+                InputTextWindow(msg.arg.keyboard.ascii);
+                if (msg.arg.keyboard.ascii == 's') {
+                    printk("sleep TaskB sleep: %s\n", task_manager->Sleep(taskb_id).Name());
+                } else if (msg.arg.keyboard.ascii == 'w') {
+                    printk("wakeup TaskB up: %s\n", task_manager->Wakeup(taskb_id).Name());
+                }
+                break;
+            default:
+                Log(kError, "Unknown message type: %d\n", msg.type);
             }
-            break;
-        default:
-            Log(kError, "Unknown message type: %d\n", msg->type);
         }
+
+        const auto tick = timer_manager->CurrentTick();
+        sprintf(str, "%010lu", tick);
+        FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
+        WriteString(*main_window->Writer(), {24, 28}, str, {0, 0, 0});
+        layer_manager->Draw(main_window_layer_id);
     }
 
     while(1) __asm__("hlt");
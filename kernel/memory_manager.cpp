@@ -1,45 +1,135 @@
-#include "logger.hpp"
 #include "memory_manager.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kMaxFrameCount}} {
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+
+namespace {
+    template <class T, class U>
+    T CeilDiv(T value, U divisor) {
+        return (value + divisor - 1) / divisor;
+    }
+}
+
+WithError<FrameID> MemoryManager::Allocate(size_t num_frames, bool zeroed) {
+    if (zeroed && num_frames == 1) {
+        SpinLockGuard guard{lock_};
+        if (auto frame = zeroed_pool_) {
+            zeroed_pool_ = frame->next;
+            --zeroed_pool_frames_;
+            frame->next = nullptr;
+            return {
+                FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame},
+                MAKE_ERROR(Error::kSuccess)
+            };
+        }
+    }
+
+    auto frame = AllocateFrames(num_frames);
+    if (frame.error.Cause() == Error::kNoEnoughMemory && DrainZeroedPool()) {
+        frame = AllocateFrames(num_frames);
+    }
+    if (!frame.error && zeroed) {
+        memset(frame.value.Frame(), 0, num_frames * kBytesPerFrame);
+    }
+    return frame;
+}
+
+bool MemoryManager::FillZeroedPool() {
+    {
+        SpinLockGuard guard{lock_};
+        if (zeroed_pool_frames_ >= kZeroedPoolFrames) return false;
+    }
+
+    // Another processor may fill the pool meanwhile, which only lets it
+    // grow past kZeroedPoolFrames by a few frames.
+    const auto frame = AllocateFrames(1);
+    if (frame.error) return false;
+
+    // The frame is ours now, so it can be zeroed with interrupts enabled
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+
+    SpinLockGuard guard{lock_};
+    auto zeroed_frame = reinterpret_cast<ZeroedFrame*>(frame.value.Frame());
+    zeroed_frame->next = zeroed_pool_;
+    zeroed_pool_ = zeroed_frame;
+    ++zeroed_pool_frames_;
+    return true;
+}
+
+bool MemoryManager::DrainZeroedPool() {
+    ZeroedFrame* frames;
+    {
+        SpinLockGuard guard{lock_};
+        frames = zeroed_pool_;
+        zeroed_pool_ = nullptr;
+        zeroed_pool_frames_ = 0;
+    }
+
+    // Free takes the lock again
+    const bool drained = frames != nullptr;
+    while (frames) {
+        auto next = frames->next;
+        Free(FrameID{reinterpret_cast<uintptr_t>(frames) / kBytesPerFrame}, 1);
+        frames = next;
+    }
+    return drained;
+}
+
+size_t BitmapMemoryManager::MapBytes(size_t num_frames) {
+    const auto map_lines = CeilDiv(num_frames, kBitsPerMapLine);
+    const auto summary_lines = CeilDiv(map_lines, kBitsPerMapLine);
+    return (summary_lines + map_lines) * sizeof(MapLineType);
+}
+
+BitmapMemoryManager::BitmapMemoryManager(void* map_buffer, size_t num_frames)
+  : summary_{reinterpret_cast<MapLineType*>(map_buffer)},
+    alloc_map_{nullptr},
+    summary_lines_{0},
+    map_lines_{CeilDiv(num_frames, kBitsPerMapLine)},
+    range_begin_{FrameID{0}},
+    range_end_{FrameID{num_frames}}
+{
+    summary_lines_ = CeilDiv(map_lines_, kBitsPerMapLine);
+    alloc_map_ = summary_ + summary_lines_;
+
+    // Bits beyond num_frames stay allocated forever
+    memset(summary_, 0xff, (summary_lines_ + map_lines_) * sizeof(MapLineType));
 }
 
 // First Fit Algorithm
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
+WithError<FrameID> BitmapMemoryManager::AllocateFrames(size_t num_frames) {
+    SpinLockGuard guard{lock_};
     size_t start_frame_id = range_begin_.ID();
     while (true) {
-        size_t offset = 0;
-        for (; offset < num_frames; ++offset) {
-            if (start_frame_id + offset >= range_end_.ID()) {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
-            if (GetBit(FrameID{start_frame_id + offset})) break;
+        start_frame_id = FindFreeFrame(start_frame_id);
+        if (start_frame_id + num_frames > range_end_.ID()) {
+            return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
         }
 
-        if (offset == num_frames) {
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
+        const size_t end_frame_id = FindAllocatedFrame(start_frame_id, start_frame_id + num_frames);
+        if (end_frame_id == start_frame_id + num_frames) {
+            SetBits(FrameID{start_frame_id}, num_frames, true);
             return {
                 FrameID{start_frame_id},
                 MAKE_ERROR(Error::kSuccess)
             };
         }
 
-        start_frame_id += offset + 1;
+        start_frame_id = end_frame_id + 1;
     }
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-    for (size_t offset = 0; offset < num_frames; ++offset) {
-        SetBit(FrameID{start_frame.ID() + offset}, false);
-    }
+    SpinLockGuard guard{lock_};
+    SetBits(start_frame, num_frames, false);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-    for (size_t i = 0; i < num_frames; ++i) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
-    }
+    SpinLockGuard guard{lock_};
+    SetBits(start_frame, num_frames, true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
@@ -47,76 +137,410 @@ void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end)
   range_end_ = range_end;
 }
 
-bool BitmapMemoryManager::GetBit(FrameID frame) const {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+MemoryStats BitmapMemoryManager::GetStats() const {
+    MemoryStats stats;
+    {
+        SpinLockGuard guard{lock_};
+        stats = {range_end_.ID() - range_begin_.ID(), free_frames_, 0};
+    }
 
-    return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+    // Interrupts are masked for one free range at a time, not the whole map
+    size_t frame_id = range_begin_.ID();
+    while (true) {
+        SpinLockGuard guard{lock_};
+        const auto free_begin = FindFreeFrame(frame_id);
+        if (free_begin >= range_end_.ID()) break;
+
+        const auto free_end = FindAllocatedFrame(free_begin, range_end_.ID());
+        stats.largest_free_frames = std::max(stats.largest_free_frames, free_end - free_begin);
+        frame_id = free_end;
+    }
+    // Frames freed during the scan must not make the range exceed the total
+    stats.largest_free_frames = std::min(stats.largest_free_frames, stats.free_frames);
+    return stats;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+size_t BitmapMemoryManager::FindNonFullLine(size_t line_index) const {
+    if (line_index >= map_lines_) return map_lines_;
 
-    if (allocated) {
-        alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
-    } else {
-        alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+    auto summary_index = line_index / kBitsPerMapLine;
+    auto bit_index = line_index % kBitsPerMapLine;
+
+    // Bits set to 1 are map lines with free frames at or after line_index
+    MapLineType non_full_bits = ~summary_[summary_index] & (~static_cast<MapLineType>(0) << bit_index);
+    while (non_full_bits == 0) {
+        ++summary_index;
+        if (summary_index >= summary_lines_) return map_lines_;
+        non_full_bits = ~summary_[summary_index];
     }
+
+    const size_t non_full_line = summary_index * kBitsPerMapLine + __builtin_ctzl(non_full_bits);
+    return std::min(non_full_line, map_lines_);
 }
 
-extern "C" caddr_t program_break, program_break_end;
+size_t BitmapMemoryManager::FindFreeFrame(size_t frame_id) const {
+    if (frame_id >= range_end_.ID()) return range_end_.ID();
 
-namespace {
-    char memory_manager_buf[sizeof(BitmapMemoryManager)];
-    BitmapMemoryManager* memory_manager;
+    auto line_index = frame_id / kBitsPerMapLine;
+    auto bit_index = frame_id % kBitsPerMapLine;
 
-    Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-        // 128MiB
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error) return heap_start.error;
+    // Bits set to 1 are free frames at or after frame_id in the line
+    MapLineType free_bits = ~alloc_map_[line_index] & (~static_cast<MapLineType>(0) << bit_index);
+    while (free_bits == 0) {
+        line_index = FindNonFullLine(line_index + 1);
+        if (line_index * kBitsPerMapLine >= range_end_.ID()) return range_end_.ID();
+        free_bits = ~alloc_map_[line_index];
+    }
+
+    const size_t free_frame_id = line_index * kBitsPerMapLine + __builtin_ctzl(free_bits);
+    return std::min(free_frame_id, range_end_.ID());
+}
+
+size_t BitmapMemoryManager::FindAllocatedFrame(size_t frame_id, size_t limit) const {
+    if (frame_id >= limit) return limit;
+
+    auto line_index = frame_id / kBitsPerMapLine;
+    auto bit_index = frame_id % kBitsPerMapLine;
 
-        program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-        return MAKE_ERROR(Error::kSuccess);
+    // Bits set to 1 are allocated frames at or after frame_id in the line
+    MapLineType allocated_bits = alloc_map_[line_index] & (~static_cast<MapLineType>(0) << bit_index);
+    while (allocated_bits == 0) {
+        ++line_index;
+        if (line_index * kBitsPerMapLine >= limit) return limit;
+        allocated_bits = alloc_map_[line_index];
     }
+
+    const size_t allocated_frame_id = line_index * kBitsPerMapLine + __builtin_ctzl(allocated_bits);
+    return std::min(allocated_frame_id, limit);
 }
 
-void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated) {
+    size_t frame_id = start_frame.ID();
+    const size_t end_frame_id = start_frame.ID() + num_frames;
 
-    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
-    uintptr_t available_end = 0;
-    for (uintptr_t iter = memory_map_base;
-        iter < memory_map_base + memory_map.map_size;
-        iter += memory_map.descriptor_size)
-    {
-        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
-        if (available_end < desc->physical_start) {
-            memory_manager->MarkAllocated(
-                FrameID{available_end / kBytesPerFrame},
-                (desc->physical_start - available_end) / kBytesPerFrame);
+    while (frame_id < end_frame_id) {
+        const auto line_index = frame_id / kBitsPerMapLine;
+        const auto bit_index = frame_id % kBitsPerMapLine;
+        const size_t width = std::min(kBitsPerMapLine - bit_index, end_frame_id - frame_id);
+
+        // Mask of `width` bits starting from bit_index
+        const MapLineType mask = width == kBitsPerMapLine
+            ? ~static_cast<MapLineType>(0)
+            : ((static_cast<MapLineType>(1) << width) - 1) << bit_index;
+
+        if (allocated) {
+            free_frames_ -= __builtin_popcountl(~alloc_map_[line_index] & mask);
+            alloc_map_[line_index] |= mask;
+        } else {
+            free_frames_ += __builtin_popcountl(alloc_map_[line_index] & mask);
+            alloc_map_[line_index] &= ~mask;
         }
 
-        const auto physical_end = desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-        if (IsAvailable(static_cast<MemoryType>(desc->type))) {
-            Log(kDebug, "type = %u, phy = %08lx - %08lx, pages = %lu, attr = %08lx\n",
-                desc->type, desc->physical_start,
-                desc->physical_start + desc->number_of_pages * kUEFIPageSize - 1,
-                desc->number_of_pages, desc->attribute);
-            available_end = physical_end;
+        const auto summary_mask = static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+        if (alloc_map_[line_index] == ~static_cast<MapLineType>(0)) {
+            summary_[line_index / kBitsPerMapLine] |= summary_mask;
         } else {
-            memory_manager->MarkAllocated(
-                FrameID{desc->physical_start / kBytesPerFrame},
-                desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+            summary_[line_index / kBitsPerMapLine] &= ~summary_mask;
         }
+        frame_id += width;
+    }
+}
+
+size_t BuddyMemoryManager::MapBytes(size_t num_frames) {
+    return num_frames * sizeof(free_order_[0]);
+}
+
+BuddyMemoryManager::BuddyMemoryManager(void* map_buffer, size_t num_frames)
+  : free_order_{reinterpret_cast<uint8_t*>(map_buffer)},
+    num_frames_{num_frames},
+    total_frames_{num_frames}
+{
+    memset(free_order_, 0, MapBytes(num_frames));
+}
+
+WithError<FrameID> BuddyMemoryManager::AllocateFrames(size_t num_frames) {
+    if (num_frames == 0) {
+        return {kNullFrame, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    unsigned int order = 0;
+    while ((static_cast<size_t>(1) << order) < num_frames) ++order;
+    if (order > kMaxOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    SpinLockGuard guard{lock_};
+    unsigned int block_order = order;
+    while (block_order <= kMaxOrder && free_lists_[block_order] == nullptr) ++block_order;
+    if (block_order > kMaxOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
     }
-    memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
 
-    if (auto err = InitializeHeap(*memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d for heap\n",
-            err.Name(), err.File(), err.Line());
+    const size_t start_frame_id = reinterpret_cast<uintptr_t>(free_lists_[block_order]) / kBytesPerFrame;
+    RemoveBlock(start_frame_id, block_order);
+
+    // Split the block until it fits, returning upper halves to the free lists
+    while (block_order > order) {
+        --block_order;
+        PushBlock(start_frame_id + (static_cast<size_t>(1) << block_order), block_order);
+    }
+
+    FreeRange(start_frame_id + num_frames, start_frame_id + (static_cast<size_t>(1) << order));
+    return {
+        FrameID{start_frame_id},
+        MAKE_ERROR(Error::kSuccess)
+    };
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    const size_t end_frame_id = std::min(start_frame.ID() + num_frames, num_frames_);
+    // Freeing a free frame again would link its block into a free list twice.
+    // A free block overlapping the range either contains its first frame or
+    // has its head inside the range.
+    size_t head;
+    unsigned int order;
+    if (start_frame.ID() < end_frame_id && FindFreeBlock(start_frame.ID(), head, order)) {
+        return MAKE_ERROR(Error::kAlreadyFreed);
+    }
+    for (size_t frame_id = start_frame.ID() + 1; frame_id < end_frame_id; ++frame_id) {
+        if (free_order_[frame_id] != 0) {
+            return MAKE_ERROR(Error::kAlreadyFreed);
+        }
+    }
+    FreeRange(start_frame.ID(), end_frame_id);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+    SpinLockGuard guard{lock_};
+    MarkRangeAllocated(start_frame.ID(), start_frame.ID() + num_frames);
+}
+
+void BuddyMemoryManager::MarkRangeAllocated(size_t begin, size_t end) {
+    size_t frame_id = begin;
+    const size_t end_frame_id = std::min(end, num_frames_);
+
+    while (frame_id < end_frame_id) {
+        size_t head;
+        unsigned int order;
+        if (!FindFreeBlock(frame_id, head, order)) {
+            ++frame_id;
+            continue;
+        }
+
+        // Take the whole block and give back the parts outside the range
+        const size_t block_end = head + (static_cast<size_t>(1) << order);
+        RemoveBlock(head, order);
+        FreeRange(head, frame_id);
+        FreeRange(std::min(block_end, end_frame_id), block_end);
+        frame_id = std::min(block_end, end_frame_id);
+    }
+}
+
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+    MarkRangeAllocated(0, range_begin.ID());
+    MarkRangeAllocated(range_end.ID(), num_frames_);
+    total_frames_ = std::min(range_end.ID(), num_frames_) - range_begin.ID();
+}
+
+MemoryStats BuddyMemoryManager::GetStats() const {
+    SpinLockGuard guard{lock_};
+    MemoryStats stats{total_frames_, free_frames_, 0};
+    for (int order = kMaxOrder; order >= 0; --order) {
+        if (free_lists_[order]) {
+            stats.largest_free_frames = static_cast<size_t>(1) << order;
+            break;
+        }
+    }
+    return stats;
+}
+
+bool BuddyMemoryManager::FindFreeBlock(size_t frame_id, size_t& head, unsigned int& order) const {
+    for (order = 0; order <= kMaxOrder; ++order) {
+        head = frame_id & ~((static_cast<size_t>(1) << order) - 1);
+        if (free_order_[head] == order + 1) return true;
+    }
+    return false;
+}
+
+void BuddyMemoryManager::PushBlock(size_t frame_id, unsigned int order) {
+    auto block = reinterpret_cast<BlockLink*>(FrameID{frame_id}.Frame());
+    block->prev = nullptr;
+    block->next = free_lists_[order];
+    if (block->next) block->next->prev = block;
+    free_lists_[order] = block;
+    free_order_[frame_id] = order + 1;
+    free_frames_ += static_cast<size_t>(1) << order;
+}
+
+void BuddyMemoryManager::RemoveBlock(size_t frame_id, unsigned int order) {
+    auto block = reinterpret_cast<BlockLink*>(FrameID{frame_id}.Frame());
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists_[order] = block->next;
+    }
+    if (block->next) block->next->prev = block->prev;
+    free_order_[frame_id] = 0;
+    free_frames_ -= static_cast<size_t>(1) << order;
+}
+
+void BuddyMemoryManager::FreeBlock(size_t frame_id, unsigned int order) {
+    while (order < kMaxOrder) {
+        const size_t buddy = frame_id ^ (static_cast<size_t>(1) << order);
+        if (buddy >= num_frames_ || free_order_[buddy] != order + 1) break;
+
+        RemoveBlock(buddy, order);
+        frame_id = std::min(frame_id, buddy);
+        ++order;
+    }
+    PushBlock(frame_id, order);
+}
+
+void BuddyMemoryManager::FreeRange(size_t begin, size_t end) {
+    end = std::min(end, num_frames_);
+    while (begin < end) {
+        unsigned int order = begin == 0 ? kMaxOrder : std::min<unsigned int>(__builtin_ctzl(begin), kMaxOrder);
+        while ((static_cast<size_t>(1) << order) > end - begin) --order;
+
+        FreeBlock(begin, order);
+        begin += static_cast<size_t>(1) << order;
+    }
+}
+
+MemoryManager* memory_manager;
+
+namespace {
+    size_t low_memory_frame_id = kNullFrame.ID();
+    // Frame 0, the allocator map, the memory map and the low memory frame are
+    // never freed. The buddy allocator writes into free frames, so they must
+    // be excluded up front.
+    std::array<std::pair<size_t, size_t>, 4> reserved_frames{};
+
+    alignas(BitmapMemoryManager) alignas(BuddyMemoryManager)
+    char memory_manager_buf[std::max(sizeof(BitmapMemoryManager), sizeof(BuddyMemoryManager))];
+
+    template <class Pred, class Func>
+    void ForEachDescriptor(const MemoryMap& memory_map, Pred pred, Func f) {
+        const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+        for (uintptr_t iter = memory_map_base;
+            iter < memory_map_base + memory_map.map_size;
+            iter += memory_map.descriptor_size)
+        {
+            auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+            if (pred(static_cast<MemoryType>(desc->type))) f(*desc);
+        }
+    }
+
+    bool IsConventional(MemoryType memory_type) {
+        return memory_type == MemoryType::kEfiConventionalMemory;
+    }
+
+    bool IsBootServices(MemoryType memory_type) {
+        return memory_type == MemoryType::kEfiBootServicesCode
+            || memory_type == MemoryType::kEfiBootServicesData;
+    }
+
+    // Frees the frames of desc outside reserved_frames
+    void FreeDescriptor(const MemoryDescriptor& desc) {
+        Log(kDebug, "type = %u, phy = %08lx - %08lx, pages = %lu, attr = %08lx\n",
+            desc.type, desc.physical_start,
+            desc.physical_start + desc.number_of_pages * kUEFIPageSize - 1,
+            desc.number_of_pages, desc.attribute);
+
+        size_t begin = desc.physical_start / kBytesPerFrame;
+        const size_t end = begin + desc.number_of_pages * kUEFIPageSize / kBytesPerFrame;
+        while (begin < end) {
+            auto covering = std::find_if(reserved_frames.begin(), reserved_frames.end(), [begin](const auto& r) {
+                return r.first <= begin && begin < r.second;
+            });
+            if (covering != reserved_frames.end()) {
+                begin = covering->second;
+                continue;
+            }
+
+            size_t free_end = end;
+            for (const auto& r : reserved_frames) {
+                if (begin < r.first && r.first < free_end) free_end = r.first;
+            }
+            memory_manager->Free(FrameID{begin}, free_end - begin);
+            begin = free_end;
+        }
+    }
+}
+
+void InitializeMemoryManager(const MemoryMap& memory_map, MemoryManagerType type) {
+    uintptr_t available_end = 0;
+    ForEachDescriptor(memory_map, IsAvailable, [&](const MemoryDescriptor& desc) {
+        const auto physical_end = desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+        available_end = std::max(available_end, physical_end);
+    });
+    const size_t num_frames = available_end / kBytesPerFrame;
+
+    // The allocator map lives in the first conventional region large enough to hold it.
+    // The memory map buffer may be in such a region, so the map must not overlap it.
+    // Boot services memory may hold the page tables in CR3, so nothing is written there.
+    const size_t map_bytes = type == MemoryManagerType::kBuddy
+        ? BuddyMemoryManager::MapBytes(num_frames)
+        : BitmapMemoryManager::MapBytes(num_frames);
+    const size_t map_frames = CeilDiv(map_bytes, kBytesPerFrame);
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    const size_t memory_map_begin = memory_map_base / kBytesPerFrame;
+    const size_t memory_map_end = CeilDiv(memory_map_base + memory_map.map_size, kBytesPerFrame);
+    FrameID map_frame = kNullFrame;
+    ForEachDescriptor(memory_map, IsConventional, [&](const MemoryDescriptor& desc) {
+        auto start_frame = std::max<size_t>(1, CeilDiv(desc.physical_start, kBytesPerFrame));
+        const auto end_frame = (desc.physical_start + desc.number_of_pages * kUEFIPageSize) / kBytesPerFrame;
+        if (start_frame < memory_map_end && memory_map_begin < start_frame + map_frames) {
+            start_frame = memory_map_end;
+        }
+        if (map_frame.ID() == kNullFrame.ID() && start_frame + map_frames <= end_frame) {
+            map_frame = FrameID{start_frame};
+        }
+    });
+    if (map_frame.ID() == kNullFrame.ID()) {
+        Log(kError, "no space for the memory manager map (%lu frames)\n", map_frames);
         exit(1);
     }
+
+    if (type == MemoryManagerType::kBuddy) {
+        ::memory_manager = new(memory_manager_buf) BuddyMemoryManager(map_frame.Frame(), num_frames);
+    } else {
+        ::memory_manager = new(memory_manager_buf) BitmapMemoryManager(map_frame.Frame(), num_frames);
+    }
+
+    // Real-mode code needs a frame addressable by a 16-bit segment. It is
+    // written after paging is set up, so boot services memory will do.
+    const size_t kLowMemoryFrames = 1_MiB / kBytesPerFrame;
+    ForEachDescriptor(memory_map, IsAvailable, [&](const MemoryDescriptor& desc) {
+        auto frame_id = std::max<size_t>(1, CeilDiv(desc.physical_start, kBytesPerFrame));
+        const auto end_frame = std::min<size_t>(
+            kLowMemoryFrames,
+            (desc.physical_start + desc.number_of_pages * kUEFIPageSize) / kBytesPerFrame);
+        for (; low_memory_frame_id == kNullFrame.ID() && frame_id < end_frame; ++frame_id) {
+            const bool in_map = map_frame.ID() <= frame_id && frame_id < map_frame.ID() + map_frames;
+            const bool in_memory_map = memory_map_begin <= frame_id && frame_id < memory_map_end;
+            if (!in_map && !in_memory_map) low_memory_frame_id = frame_id;
+        }
+    });
+    const size_t low_memory_end =
+        low_memory_frame_id == kNullFrame.ID() ? 0 : low_memory_frame_id + 1;
+
+    reserved_frames = {{
+        {0, 1},
+        {map_frame.ID(), map_frame.ID() + map_frames},
+        {memory_map_begin, memory_map_end},
+        {low_memory_end == 0 ? 0 : low_memory_frame_id, low_memory_end},
+    }};
+    ForEachDescriptor(memory_map, IsConventional, FreeDescriptor);
+    memory_manager->SetMemoryRange(FrameID{1}, FrameID{num_frames});
+}
+
+void ReleaseBootServicesMemory(const MemoryMap& memory_map) {
+    ForEachDescriptor(memory_map, IsBootServices, FreeDescriptor);
+}
+
+FrameID LowMemoryFrame() {
+    return FrameID{low_memory_frame_id};
 }
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
 #include <limits>
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace {
     constexpr unsigned long long operator""_KiB(unsigned long long kib) {
@@ -33,30 +36,189 @@ private:
 
 static const FrameID kNullFrame(std::numeric_limits<size_t>::max());
 
-class BitmapMemoryManager {
+struct MemoryStats {
+    // Frames in the managed range
+    size_t total_frames;
+    size_t free_frames;
+    // Frames in the largest contiguous free range
+    size_t largest_free_frames;
+
+    size_t UsedFrames() const { return total_frames - free_frames; }
+
+    // 0 when all free frames are contiguous, close to 100 when they are scattered
+    unsigned int FragmentationIndex() const {
+        if (free_frames == 0) return 0;
+        return 100 - largest_free_frames * 100 / free_frames;
+    }
+};
+
+class MemoryManager {
 public:
-    static const auto kMaxPhysicalMemoryBytes{128_GiB};
-    static const auto kMaxFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
+    // Number of zero-filled frames kept ready for Allocate(1, true)
+    static const size_t kZeroedPoolFrames = 256;
+
+    virtual ~MemoryManager() = default;
+
+    WithError<FrameID> Allocate(size_t num_frames) { return Allocate(num_frames, false); }
+    virtual Error Free(FrameID start_frame, size_t num_frames) = 0;
+    virtual void MarkAllocated(FrameID start_frame, size_t num_frames) = 0;
+
+    virtual void SetMemoryRange(FrameID range_begin, FrameID range_end) = 0;
+
+    virtual MemoryStats GetStats() const = 0;
+    size_t ZeroedPoolFrames() const { return zeroed_pool_frames_; }
+
+    // Allocates frames filled with zeros when zeroed is true. Single frames
+    // are taken from the pool of frames zeroed in the background. When the
+    // allocator runs out, the pool is given back to it before failing.
+    WithError<FrameID> Allocate(size_t num_frames, bool zeroed);
+    // Zeroes a free frame and puts it in the pool. Returns false when the
+    // pool is full or there is no free frame. Called by the idle task.
+    bool FillZeroedPool();
+
+protected:
+    // Guards the zeroed pool and the state of the derived allocators.
+    // SetMemoryRange runs before other processors start and does not take it.
+    mutable SpinLock lock_;
+
+    // Allocates from the frames outside the zeroed pool
+    virtual WithError<FrameID> AllocateFrames(size_t num_frames) = 0;
+
+private:
+    // Zeroed frames are linked through their first 8 bytes
+    struct ZeroedFrame {
+        ZeroedFrame* next;
+    };
+
+    ZeroedFrame* zeroed_pool_{nullptr};
+    size_t zeroed_pool_frames_{0};
+
+    // Frees the frames of the zeroed pool. Returns false if it was empty.
+    bool DrainZeroedPool();
+};
 
+class BitmapMemoryManager : public MemoryManager {
+public:
     using MapLineType = unsigned long;
     // Number of frames (= bits) in an element of the bitmap array
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-    BitmapMemoryManager();
+    // Bytes of the buffer required to manage frames in [0, num_frames)
+    static size_t MapBytes(size_t num_frames);
+
+    // map_buffer must have MapBytes(num_frames) bytes. All frames are
+    // initially marked as allocated.
+    BitmapMemoryManager(void* map_buffer, size_t num_frames);
+
+    virtual Error Free(FrameID start_frame, size_t num_frames) override;
+    virtual void MarkAllocated(FrameID start_frame, size_t num_frames) override;
 
-    WithError<FrameID> Allocate(size_t num_frames);
-    Error Free(FrameID start_frame, size_t num_frames);
-    void MarkAllocated(FrameID start_frame, size_t num_frames);
+    virtual void SetMemoryRange(FrameID range_begin, FrameID range_end) override;
 
-    void SetMemoryRange(FrameID range_begin, FrameID range_end);
+    // free_frames is counted as frames change. largest_free_frames comes
+    // from a scan which takes the lock once per free range, so it may be
+    // off while other processors allocate.
+    virtual MemoryStats GetStats() const override;
 
 private:
-    std::array<MapLineType, kMaxFrameCount / kBitsPerMapLine> alloc_map_;
+    virtual WithError<FrameID> AllocateFrames(size_t num_frames) override;
+
+    // Bit i of summary_ is set when alloc_map_[i] is fully allocated
+    MapLineType* summary_;
+    MapLineType* alloc_map_;
+    size_t summary_lines_;
+    size_t map_lines_;
     FrameID range_begin_;
     FrameID range_end_;
+    size_t free_frames_{0};
+
+    // Returns the first map line at or after line_index which has a free frame
+    size_t FindNonFullLine(size_t line_index) const;
+    // Returns the first free frame at or after frame_id (range_end_ if none)
+    size_t FindFreeFrame(size_t frame_id) const;
+    // Returns the first allocated frame in [frame_id, limit) (limit if none)
+    size_t FindAllocatedFrame(size_t frame_id, size_t limit) const;
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+};
+
+// Buddy system allocator. A request is served from a block of 2^order frames
+// and the unused tail of the block is returned to the free lists right away,
+// so Allocate/Free keep the same frame-granular semantics as the bitmap.
+class BuddyMemoryManager : public MemoryManager {
+public:
+    // Largest block has 2^kMaxOrder frames (4 GiB)
+    static constexpr unsigned int kMaxOrder = 20;
+
+    // Bytes of the buffer required to manage frames in [0, num_frames)
+    static size_t MapBytes(size_t num_frames);
+
+    // map_buffer must have MapBytes(num_frames) bytes. All frames are
+    // initially marked as allocated.
+    BuddyMemoryManager(void* map_buffer, size_t num_frames);
+
+    virtual Error Free(FrameID start_frame, size_t num_frames) override;
+    virtual void MarkAllocated(FrameID start_frame, size_t num_frames) override;
+
+    virtual void SetMemoryRange(FrameID range_begin, FrameID range_end) override;
+
+    // largest_free_frames is the size of the largest free block
+    virtual MemoryStats GetStats() const override;
+
+private:
+    virtual WithError<FrameID> AllocateFrames(size_t num_frames) override;
+
+    // Link written at the head frame of every free block
+    struct BlockLink {
+        BlockLink* prev;
+        BlockLink* next;
+    };
+
+    // free_order_[i] is order + 1 when frame i is the head of a free block, 0 otherwise
+    uint8_t* free_order_;
+    size_t num_frames_;
+    size_t total_frames_;
+    size_t free_frames_{0};
+    std::array<BlockLink*, kMaxOrder + 1> free_lists_{};
+
+    // Finds the free block containing frame_id. False if the frame is allocated.
+    bool FindFreeBlock(size_t frame_id, size_t& head, unsigned int& order) const;
+    void PushBlock(size_t frame_id, unsigned int order);
+    void RemoveBlock(size_t frame_id, unsigned int order);
+    // Frees a block of 2^order frames, merging it with its free buddies
+    void FreeBlock(size_t frame_id, unsigned int order);
+    // Frees [begin, end) as a sequence of aligned blocks
+    void FreeRange(size_t begin, size_t end);
+    // MarkAllocated without taking the lock
+    void MarkRangeAllocated(size_t begin, size_t end);
+};
 
-    bool GetBit(FrameID frame) const;
-    void SetBit(FrameID frame, bool allocated);
+enum class MemoryManagerType {
+    kBitmap,
+    kBuddy,
 };
 
-void InitializeMemoryManager(const MemoryMap& memory_map);
+// Chosen at build time with make FRAME_ALLOCATOR=buddy
+#ifdef BUDDY_FRAME_ALLOCATOR
+const MemoryManagerType kDefaultMemoryManagerType = MemoryManagerType::kBuddy;
+#else
+const MemoryManagerType kDefaultMemoryManagerType = MemoryManagerType::kBitmap;
+#endif
+
+extern MemoryManager* memory_manager;
+
+/**
+ * A frame below 1 MiB which InitializeMemoryManager keeps out of the free
+ * pool for real-mode code, such as the startup code of application
+ * processors. kNullFrame if no such frame is available.
+ */
+FrameID LowMemoryFrame();
+
+/**
+ * Manage the frames of conventional memory. Boot services memory stays
+ * allocated, since the page tables of the firmware may be in it while they
+ * are still loaded in CR3.
+ */
+void InitializeMemoryManager(
+    const MemoryMap& memory_map, MemoryManagerType type = kDefaultMemoryManagerType);
+// Frees boot services memory. Call once CR3 holds the kernel's page tables.
+void ReleaseBootServicesMemory(const MemoryMap& memory_map);
@@ -5,6 +5,8 @@ struct Message {
         kInterruptXHCI,
         kTimerTimeout,
         kKeyPush,
+        kMouseMove,
+        kConsoleDraw,
     } type;
 
     union {
@@ -18,5 +20,13 @@ struct Message {
             uint8_t keycode;
             char ascii;
         } keyboard;
+
+        // Reports with the same buttons may be merged by adding up the
+        // displacements
+        struct {
+            int displacement_x;
+            int displacement_y;
+            uint8_t buttons;
+        } mouse;
     } arg;
 };
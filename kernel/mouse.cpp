@@ -3,6 +3,7 @@
 #include "layer.hpp"
 #include "logger.hpp"
 #include "mouse.hpp"
+#include "task.hpp"
 #include "usb/classdriver/mouse.hpp"
 
 namespace {
@@ -34,6 +35,8 @@ const char mouse_cursor_shape[kMouseCursorHeight][kMouseCursorWidth + 1] = {
   "         @@@   ",
 };
 
+std::shared_ptr<Mouse> mouse;
+
 // bit position 0 is for left button (1: right button, 2: center button)
 const int LEFT_MOUSE_BUTTON_MASK = 0x01;
 
@@ -60,7 +63,7 @@ void Mouse::SetPosition(Vector2D<int> position) {
     layer_manager->Move(layer_id_, position_);
 }
 
-void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+void Mouse::OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y) {
     const auto oldpos = position_;
     auto new_pos = position_ + Vector2D<int>{displacement_x, displacement_y};
     new_pos = ElementMin(new_pos, ScreenSize() + Vector2D<int>{-1, -1});
@@ -101,11 +104,19 @@ void InitializeMouse() {
         .SetWindow(mouse_window)
         .ID();
 
-    auto mouse = std::make_shared<Mouse>(mouse_layer_id);
+    mouse = std::make_shared<Mouse>(mouse_layer_id);
     mouse->SetPosition({200, 200});
     layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
-    usb::HIDMouseDriver::default_observer = [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-        mouse->OnInterrupt(buttons, displacement_x, displacement_y);
+    usb::HIDMouseDriver::default_observer = [](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+        Message msg{Message::kMouseMove};
+        msg.arg.mouse.displacement_x = displacement_x;
+        msg.arg.mouse.displacement_y = displacement_y;
+        msg.arg.mouse.buttons = buttons;
+        task_manager->SendMessage(1, msg);
     };
 }
+
+void ProcessMouseMessage(const Message& msg) {
+    mouse->OnInterrupt(msg.arg.mouse.buttons, msg.arg.mouse.displacement_x, msg.arg.mouse.displacement_y);
+}
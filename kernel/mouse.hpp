@@ -1,6 +1,7 @@
 #pragma once
 
 #include "graphics.hpp"
+#include "message.hpp"
 
 const int kMouseCursorWidth = 15;
 const int kMouseCursorHeight = 24;
@@ -11,7 +12,7 @@ void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position);
 class Mouse {
 public:
     Mouse(unsigned int layer_id);
-    void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    void OnInterrupt(uint8_t buttons, int displacement_x, int displacement_y);
 
     unsigned int LayerID() const { return layer_id_; }
     void SetPosition(Vector2D<int> position);
@@ -24,4 +25,6 @@ private:
     uint8_t previous_buttons_{0};
 };
 
+// Reports of the USB mouse are sent to the main task as kMouseMove messages
 void InitializeMouse();
+void ProcessMouseMessage(const Message& msg);
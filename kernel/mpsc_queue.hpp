@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * A bounded lock-free queue with any number of producers and a single
+ * consumer. Push never allocates, blocks or masks interrupts, so interrupt
+ * handlers and other processors can use it. When the queue is full the new
+ * element is dropped and counted.
+ *
+ * Each cell carries a sequence number telling whether it is free for the
+ * push at its position or holds the element for the pop at its position.
+ * A producer interrupted between claiming a cell and filling it only hides
+ * the elements behind it until it resumes.
+ */
+template <typename T, size_t N>
+class MPSCQueue {
+public:
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+    static const size_t kCacheLineBytes = 64;
+
+    MPSCQueue() {
+        for (size_t i = 0; i < N; ++i) {
+            cells_[i].seq = i;
+        }
+    }
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    // Returns false if the queue is full
+    bool Push(const T& value) {
+        size_t pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+        while (true) {
+            Cell& cell = cells_[pos & (N - 1)];
+            const size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+            const auto diff = static_cast<intptr_t>(seq - pos);
+            if (diff == 0) {
+                // A failed exchange reloads pos
+                if (__atomic_compare_exchange_n(&tail_, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    cell.value = value;
+                    __atomic_store_n(&cell.seq, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // The cell still holds the element pushed N positions before
+                __atomic_add_fetch(&drops_, 1, __ATOMIC_RELAXED);
+                return false;
+            } else {
+                pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Only the consumer may call Pop and Ready
+    bool Pop(T& value) {
+        Cell& cell = cells_[head_ & (N - 1)];
+        if (__atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE) != head_ + 1) {
+            return false;
+        }
+        value = cell.value;
+        __atomic_store_n(&cell.seq, head_ + N, __ATOMIC_RELEASE);
+        ++head_;
+        return true;
+    }
+
+    // True if Pop would succeed
+    bool Ready() const {
+        const Cell& cell = cells_[head_ & (N - 1)];
+        return __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE) == head_ + 1;
+    }
+
+    // Number of elements dropped because the queue was full
+    uint64_t Drops() const { return __atomic_load_n(&drops_, __ATOMIC_RELAXED); }
+
+private:
+    struct Cell {
+        size_t seq;
+        T value;
+    };
+
+    // Producers and the consumer update their positions on separate lines
+    alignas(kCacheLineBytes) size_t tail_{0};
+    alignas(kCacheLineBytes) size_t head_{0};
+    alignas(kCacheLineBytes) uint64_t drops_{0};
+    alignas(kCacheLineBytes) std::array<Cell, N> cells_;
+};
@@ -1,18 +1,7 @@
 #include <errno.h>
 #include <sys/types.h>
 
-caddr_t program_break, program_break_end;
-
-caddr_t sbrk(int incr) {
-    if (program_break == 0 || program_break + incr >= program_break_end) {
-        errno = ENOMEM;
-        return (caddr_t)-1;
-    }
-
-    caddr_t prev_break = program_break;
-    program_break += incr;
-    return prev_break;
-}
+// sbrk is implemented by the kernel heap (heap.cpp)
 
 void _exit(void) {
     while (1) __asm__("hlt");
@@ -1,32 +1,349 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
 
 #include "asmfunc.h"
+#include "logger.hpp"
 
 namespace {
-    const uint64_t kPageSize4K = 4096;
-    const uint64_t kPageSize2M = 512 * kPageSize4K;
-    const uint64_t kPageSize1G = 512 * kPageSize2M;
-
     alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
-    alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
-    alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+    alignas(PageMap) char kernel_page_map_buf[sizeof(PageMap)];
+
+    const uint64_t kPageAddressMask = 0x000ffffffffff000;
+    const uint64_t kPagePresent = 0x001;
+    const uint64_t kPageLarge = 0x080;
+    const uint64_t kPageAttributeMask =
+        kPageWritable | kPageUser | kPageUncached | kPageGlobal;
+
+    const uint32_t kCPUIDPCID = 1u << 17; // CPUID.01H:ECX
+    const uint32_t kCPUIDPage1GB = 1u << 26; // CPUID.80000001H:EDX
+    const uint32_t kCPUIDPAT = 1u << 16; // CPUID.01H:EDX
+    const uint64_t kCR4PCIDE = 1ul << 17;
+    const uint64_t kCR3NoFlush = 1ul << 63;
+
+    const uint32_t kMSRPAT = 0x277;
+    const uint64_t kPATWriteCombining = 0x01;
+
+    bool use_1g_pages = false;
+
+    // Bytes mapped by an entry of a table of the given level (1 = page table)
+    uint64_t EntrySize(int level) {
+        return kPageSize4K << (9 * (level - 1));
+    }
+
+    uint64_t& EntryAt(uint64_t* table, int level, uint64_t virt_addr) {
+        return table[(virt_addr / EntrySize(level)) % 512];
+    }
+
+    uint64_t* TableOf(uint64_t entry) {
+        return reinterpret_cast<uint64_t*>(entry & kPageAddressMask);
+    }
+
+    // Returns the table referred by entry, allocating an empty one if it is not present
+    WithError<uint64_t*> GetOrNewTable(uint64_t& entry, uint64_t attr) {
+        if (entry & kPagePresent) {
+            entry |= attr & kPageUser;
+            return {TableOf(entry), MAKE_ERROR(Error::kSuccess)};
+        }
+
+        const auto frame = memory_manager->Allocate(1, true);
+        if (frame.error) return {nullptr, frame.error};
+
+        auto table = reinterpret_cast<uint64_t*>(frame.value.Frame());
+        entry = reinterpret_cast<uint64_t>(table) | kPagePresent | kPageWritable | (attr & kPageUser);
+        return {table, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    // Replaces the large page in entry by a table of 512 pages of page_size / 512
+    // with the same attributes
+    Error SplitLargePage(uint64_t& entry, uint64_t page_size) {
+        const auto frame = memory_manager->Allocate(1);
+        if (frame.error) return frame.error;
+
+        auto table = reinterpret_cast<uint64_t*>(frame.value.Frame());
+        const uint64_t base = entry & kPageAddressMask & ~(page_size - 1);
+        const uint64_t sub_page_size = page_size / 512;
+        const uint64_t flags = (entry & kPageAttributeMask) | kPagePresent
+            | (sub_page_size > kPageSize4K ? kPageLarge : 0);
+        for (int i = 0; i < 512; ++i) {
+            table[i] = (base + i * sub_page_size) | flags;
+        }
+        entry = reinterpret_cast<uint64_t>(table) | kPagePresent | kPageWritable | (entry & kPageUser);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    bool Supports1GPages() {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < 0x80000001) return false;
+        CPUID(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        return edx & kCPUIDPage1GB;
+    }
+}
+
+PageMap* kernel_page_map;
+uint64_t cr3_load_flags = 0;
+
+PageMap::PageMap(uint64_t* pml4_table) : pml4_{pml4_table} {}
+
+Error PageMap::Map(uint64_t virt_addr, uint64_t phys_addr, uint64_t bytes, uint64_t attr) {
+    SpinLockGuard guard{lock_};
+    uint64_t virt = virt_addr & ~(kPageSize4K - 1);
+    uint64_t phys = phys_addr & ~(kPageSize4K - 1);
+    const uint64_t virt_end = (virt_addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+
+    while (virt < virt_end) {
+        int page_level = use_1g_pages ? 3 : 2;
+        for (; page_level > 1; --page_level) {
+            const auto page_size = EntrySize(page_level);
+            if ((virt | phys) % page_size == 0 && virt + page_size <= virt_end) break;
+        }
+
+        if (auto err = MapPage(virt, phys, page_level, attr)) return err;
+        virt += EntrySize(page_level);
+        phys += EntrySize(page_level);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error PageMap::Unmap(uint64_t virt_addr, uint64_t bytes) {
+    SpinLockGuard guard{lock_};
+    const uint64_t begin = virt_addr & ~(kPageSize4K - 1);
+    const uint64_t end = (virt_addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    return UnmapRange(pml4_, 4, begin, end);
 }
 
-void SetupIdentityPageTable() {
-    pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
-    for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
-        pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
-        for (int i_pd = 0; i_pd < 512; ++i_pd) {
-            // Size of a page table is 2MB
-            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+Error PageMap::Protect(uint64_t virt_addr, uint64_t bytes, uint64_t attr) {
+    SpinLockGuard guard{lock_};
+    const uint64_t begin = virt_addr & ~(kPageSize4K - 1);
+    const uint64_t end = (virt_addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    return ProtectRange(pml4_, 4, begin, end, attr & kPageAttributeMask);
+}
+
+void PageMap::Flush() {
+    SpinLockGuard guard{lock_};
+    FlushLocked();
+}
+
+void PageMap::FlushLocked() {
+    const bool active = (GetCR3() & kPageAddressMask) == reinterpret_cast<uint64_t>(pml4_);
+    if (active && flush_all_) {
+        // Without bit 63 the load flushes the entries of the current PCID
+        SetCR3(GetCR3());
+    } else if (active) {
+        for (size_t i = 0; i < num_pending_; ++i) {
+            InvalidatePage(pending_[i]);
         }
     }
+    num_pending_ = 0;
+    flush_all_ = false;
 
-    SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+    // No processor walks the tables any more
+    for (size_t i = 0; i < num_pending_frees_; ++i) {
+        memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(pending_frees_[i]) / kBytesPerFrame}, 1);
+    }
+    num_pending_frees_ = 0;
 }
 
-void InitializePaging() {
-    SetupIdentityPageTable();
+Error PageMap::MapPage(uint64_t virt_addr, uint64_t phys_addr, int page_level, uint64_t attr) {
+    uint64_t* table = pml4_;
+    for (int level = 4; level > page_level; --level) {
+        auto& entry = EntryAt(table, level, virt_addr);
+        if (entry & kPageLarge) {
+            // already covered by a large page
+            return MAKE_ERROR(Error::kAlreadyAllocated);
+        }
+
+        const auto next = GetOrNewTable(entry, attr);
+        if (next.error) return next.error;
+        table = next.value;
+    }
+
+    auto& entry = EntryAt(table, page_level, virt_addr);
+    if (entry & kPagePresent) return MAKE_ERROR(Error::kAlreadyAllocated);
+    entry = phys_addr | kPagePresent | (attr & kPageAttributeMask)
+        | (page_level > 1 ? kPageLarge : 0);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error PageMap::UnmapRange(uint64_t* table, int level, uint64_t begin, uint64_t end) {
+    const uint64_t entry_size = EntrySize(level);
+    for (uint64_t addr = begin & ~(entry_size - 1); addr < end; addr += entry_size) {
+        auto& entry = EntryAt(table, level, addr);
+        if ((entry & kPagePresent) == 0) continue;
+
+        const bool covered = begin <= addr && addr + entry_size <= end;
+        const bool leaf = level == 1 || (entry & kPageLarge);
+        if (leaf && covered) {
+            entry = 0;
+            QueueInvalidation(addr);
+            continue;
+        }
+        if (leaf) {
+            if (auto err = SplitLargePage(entry, entry_size)) return err;
+        }
+
+        auto next = TableOf(entry);
+        if (auto err = UnmapRange(next, level - 1, std::max(begin, addr),
+                                  std::min(end, addr + entry_size))) {
+            return err;
+        }
+        if (covered || std::all_of(next, next + 512, [](uint64_t e) { return e == 0; })) {
+            entry = 0;
+            QueueFree(next, addr);
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error PageMap::ProtectRange(uint64_t* table, int level, uint64_t begin, uint64_t end, uint64_t attr) {
+    const uint64_t entry_size = EntrySize(level);
+    for (uint64_t addr = begin & ~(entry_size - 1); addr < end; addr += entry_size) {
+        auto& entry = EntryAt(table, level, addr);
+        if ((entry & kPagePresent) == 0) return MAKE_ERROR(Error::kIndexOutOfRange);
+
+        const bool covered = begin <= addr && addr + entry_size <= end;
+        const bool leaf = level == 1 || (entry & kPageLarge);
+        if (leaf && covered) {
+            entry = (entry & ~kPageAttributeMask) | attr;
+            QueueInvalidation(addr);
+            continue;
+        }
+        if (leaf) {
+            if (auto err = SplitLargePage(entry, entry_size)) return err;
+            // The large page may be cached in the TLB as a whole
+            QueueInvalidation(addr);
+        }
+
+        entry |= attr & kPageUser;
+        if (auto err = ProtectRange(TableOf(entry), level - 1, std::max(begin, addr),
+                                    std::min(end, addr + entry_size), attr)) {
+            return err;
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void PageMap::QueueInvalidation(uint64_t virt_addr) {
+    if (num_pending_ == pending_.size()) {
+        flush_all_ = true;
+        return;
+    }
+    pending_[num_pending_++] = virt_addr;
+}
+
+void PageMap::QueueFree(uint64_t* table, uint64_t virt_addr) {
+    if (num_pending_frees_ == pending_frees_.size()) {
+        FlushLocked();
+    }
+    // Invalidation also drops the cached walks through the table
+    QueueInvalidation(virt_addr);
+    pending_frees_[num_pending_frees_++] = table;
+}
+
+void SetupIdentityPageTable(const MemoryMap& memory_map, const FrameBufferConfig& frame_buffer_config) {
+    // Local APIC, I/O APIC and most 32-bit BARs live just below 4 GiB
+    uint64_t identity_end = 4 * kPageSize1G;
+
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for (uintptr_t iter = memory_map_base;
+        iter < memory_map_base + memory_map.map_size;
+        iter += memory_map.descriptor_size)
+    {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+        identity_end = std::max(identity_end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    }
+
+    const auto frame_buffer_end = reinterpret_cast<uint64_t>(frame_buffer_config.frame_buffer)
+        + 4ul * frame_buffer_config.pixels_per_scan_line * frame_buffer_config.vertical_resolution;
+    identity_end = std::max(identity_end, frame_buffer_end);
+
+    use_1g_pages = Supports1GPages();
+    kernel_page_map = new(kernel_page_map_buf) PageMap{&pml4_table[0]};
+
+    const uint64_t num_gib = (identity_end + kPageSize1G - 1) / kPageSize1G;
+    if (auto err = kernel_page_map->Map(0, 0, num_gib * kPageSize1G, kPageWritable)) {
+        Log(kError, "failed to build the identity map: %s\n", err.Name());
+        exit(1);
+    }
+    Log(kInfo, "identity mapped %lu GiB with %s pages\n", num_gib, use_1g_pages ? "1GiB" : "2MiB");
+
+    SetCR3(MakeCR3(reinterpret_cast<uint64_t>(&pml4_table[0]), kKernelPCID));
+}
+
+void SetupPCID() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx & kCPUIDPCID) == 0) {
+        return;
+    }
+
+    // CR3[11:0] holds kKernelPCID, 0, which setting CR4.PCIDE requires
+    SetCR4(GetCR4() | kCR4PCIDE);
+    cr3_load_flags = kCR3NoFlush;
+}
+
+// Turns PAT entry 1 from write-through into write-combining
+bool SetupPAT() {
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((edx & kCPUIDPAT) == 0) {
+        return false;
+    }
+
+    const uint64_t pat = ReadMSR(kMSRPAT);
+    WriteMSR(kMSRPAT, (pat & ~(0xfful << 8)) | (kPATWriteCombining << 8));
+    return true;
+}
+
+void MapFrameBufferWriteCombining(const FrameBufferConfig& frame_buffer_config) {
+    if (!SetupPAT()) {
+        Log(kWarn, "PAT is not supported. The frame buffer stays uncached\n");
+        return;
+    }
+
+    const auto frame_buffer_begin = reinterpret_cast<uint64_t>(frame_buffer_config.frame_buffer);
+    const auto frame_buffer_end = frame_buffer_begin
+        + 4ul * frame_buffer_config.pixels_per_scan_line * frame_buffer_config.vertical_resolution;
+    if (auto err = kernel_page_map->Protect(frame_buffer_begin, frame_buffer_end - frame_buffer_begin,
+                                            kPageWritable | kPageWriteCombining)) {
+        Log(kWarn, "failed to map the frame buffer as write-combining: %s\n", err.Name());
+    }
+    kernel_page_map->Flush();
+}
+
+void InitializePaging(const MemoryMap& memory_map, const FrameBufferConfig& frame_buffer_config) {
+    SetupIdentityPageTable(memory_map, frame_buffer_config);
+    MapFrameBufferWriteCombining(frame_buffer_config);
+    SetupPCID();
+}
+
+void InitializeAPPaging() {
+    // The PAT must be the same on all processors sharing the page tables
+    SetupPAT();
+    if (PCIDEnabled()) {
+        SetCR4(GetCR4() | kCR4PCIDE);
+    }
+}
+
+bool PCIDEnabled() {
+    return cr3_load_flags & kCR3NoFlush;
+}
+
+uint64_t MakeCR3(uint64_t pml4_addr, uint16_t pcid) {
+    if (!PCIDEnabled()) {
+        return pml4_addr & kPageAddressMask;
+    }
+    return (pml4_addr & kPageAddressMask) | (pcid & kMaxPCID);
+}
+
+Error MapIdentity(uint64_t phys_addr, uint64_t bytes) {
+    // The identity map is built in whole GiBs, so a GiB with any mapping is complete
+    const uint64_t gib_end = (phys_addr + bytes + kPageSize1G - 1) / kPageSize1G;
+    for (uint64_t gib = phys_addr / kPageSize1G; gib < gib_end; ++gib) {
+        auto err = kernel_page_map->Map(gib * kPageSize1G, gib * kPageSize1G, kPageSize1G, kPageWritable);
+        if (err && err.Cause() != Error::kAlreadyAllocated) return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
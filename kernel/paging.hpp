@@ -1,7 +1,110 @@
 #pragma once
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
 
-const size_t kPageDirectoryCount = 64;
+#include "error.hpp"
+#include "frame_buffer_config.hpp"
+#include "memory_manager.hpp"
+#include "memory_map.hpp"
+#include "spinlock.hpp"
 
-void InitializePaging();
+const uint64_t kPageSize4K = 4096;
+const uint64_t kPageSize2M = 512 * kPageSize4K;
+const uint64_t kPageSize1G = 512 * kPageSize2M;
+
+// Attributes of a mapping, given to PageMap::Map and PageMap::Protect
+const uint64_t kPageWritable = 0x002;
+const uint64_t kPageUser = 0x004;
+// Selects PAT entry 1, which InitializePaging programs as write-combining
+const uint64_t kPageWriteCombining = 0x008;
+const uint64_t kPageUncached = 0x018;
+const uint64_t kPageGlobal = 0x100;
+
+// ORed into a task's CR3 when SwitchContext loads it. Bit 63 is set when
+// PCIDs are enabled so that the TLB entries of the address space survive.
+extern "C" uint64_t cr3_load_flags;
+
+// The kernel page map, which every task runs on, is tagged with this PCID
+const uint16_t kKernelPCID = 0;
+const uint16_t kMaxPCID = 4095;
+
+/**
+ * A 4-level page table rooted at a PML4 table.
+ *
+ * Map, Unmap and Protect use the largest of the 4 KiB, 2 MiB and 1 GiB pages
+ * that fits the alignment of the range, and split large pages crossing its
+ * edges. Page tables are allocated from the memory manager. Tables emptied
+ * by Unmap are freed by the next Flush, since the processor may walk them
+ * until their TLB entries are invalidated.
+ *
+ * Changes to existing mappings are not visible until Flush is called, which
+ * lets several operations share one round of invlpg. Flush only invalidates
+ * the TLB of the calling processor; mappings are not removed while other
+ * processors may hold them.
+ */
+class PageMap {
+public:
+    // Up to this number of pages are invalidated one by one. More pending
+    // invalidations fall back to reloading CR3.
+    static const size_t kMaxPendingInvalidations = 32;
+    // Page tables waiting for Flush to free them. Unmap flushes early when
+    // more are emptied.
+    static const size_t kMaxPendingFrees = 32;
+
+    PageMap(uint64_t* pml4_table);
+
+    // Maps [virt_addr, virt_addr + bytes) to physical memory from phys_addr.
+    // Returns kAlreadyAllocated if a page of the range is mapped.
+    Error Map(uint64_t virt_addr, uint64_t phys_addr, uint64_t bytes, uint64_t attr);
+    // Removes the mappings in the range. Holes are skipped.
+    Error Unmap(uint64_t virt_addr, uint64_t bytes);
+    // Replaces the attributes of the pages in the range, which must be mapped
+    Error Protect(uint64_t virt_addr, uint64_t bytes, uint64_t attr);
+    // Invalidates the TLB entries of pages changed since the last Flush and
+    // frees the page tables emptied since then. Needed after Unmap even when
+    // this page map is not the current address space.
+    void Flush();
+
+    uint64_t* PML4() const { return pml4_; }
+
+private:
+    uint64_t* pml4_;
+    SpinLock lock_;
+    std::array<uint64_t, kMaxPendingInvalidations> pending_{};
+    size_t num_pending_{0};
+    bool flush_all_{false};
+    std::array<uint64_t*, kMaxPendingFrees> pending_frees_{};
+    size_t num_pending_frees_{0};
+
+    Error MapPage(uint64_t virt_addr, uint64_t phys_addr, int page_level, uint64_t attr);
+    Error UnmapRange(uint64_t* table, int level, uint64_t begin, uint64_t end);
+    Error ProtectRange(uint64_t* table, int level, uint64_t begin, uint64_t end, uint64_t attr);
+    void QueueInvalidation(uint64_t virt_addr);
+    // Frees table at the next flush. virt_addr is an address it mapped.
+    void QueueFree(uint64_t* table, uint64_t virt_addr);
+    void FlushLocked();
+};
+
+// The page map of the kernel, which identity maps physical memory
+extern PageMap* kernel_page_map;
+
+// Identity maps the physical memory in memory_map, the frame buffer and at
+// least the first 4 GiB. 1 GiB pages are used when the CPU supports them.
+// The memory manager must be initialized beforehand.
+void InitializePaging(const MemoryMap& memory_map, const FrameBufferConfig& frame_buffer_config);
+
+// Applies the PAT and PCID settings of InitializePaging to an application
+// processor which already runs on the kernel page map
+void InitializeAPPaging();
+
+bool PCIDEnabled();
+
+// Returns a CR3 value for the address space rooted at pml4_addr. The PCID is
+// dropped when the CPU does not support it.
+uint64_t MakeCR3(uint64_t pml4_addr, uint16_t pcid);
+
+// Extends the identity map to cover [phys_addr, phys_addr + bytes), e.g. for
+// MMIO ranges above the end of the memory map.
+Error MapIdentity(uint64_t phys_addr, uint64_t bytes);
@@ -1,9 +1,17 @@
 #include "segment.hpp"
 
 #include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
 
 namespace {
-    std::array<SegmentDescriptor, 3> gdt;
+    // The TSS descriptor takes two entries
+    using GDT = std::array<SegmentDescriptor, 5>;
+    using TSS = std::array<uint32_t, 26>;
+    std::array<GDT, kMaxCPUs> gdts;
+    std::array<TSS, kMaxCPUs> tsss;
+
+    static_assert((kTSS >> 3) + 1 < std::tuple_size<GDT>::value);
 }
 
 void SetCodeSegment(
@@ -44,7 +52,22 @@ void SetDataSegment(
     desc.bits.default_operation_size = 1;
 }
 
-void SetupSegments() {
+void SetSystemSegment(
+    SegmentDescriptor& desc,
+    DescriptorType type,
+    unsigned int descriptor_privilege_level,
+    uint32_t base,
+    uint32_t limit)
+{
+    SetCodeSegment(desc, type, descriptor_privilege_level, base, limit);
+    desc.bits.system_segment = 0;
+    desc.bits.long_mode = 0;
+    desc.bits.granularity = 0;
+}
+
+void SetupSegments(int cpu) {
+    auto& gdt = gdts[cpu];
+
     // null descriptor
     gdt[0].data = 0;
 
@@ -58,9 +81,34 @@ void SetupSegments() {
     LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
 }
 
-void InitializeSegmentation() {
-    SetupSegments();
+void InitializeSegmentation(int cpu) {
+    SetupSegments(cpu);
 
     SetDSAll(kKernelDS); // Point segment registers to the null descriptor
     SetCSSS(kKernelCS, kKernelSS);
+}
+
+void InitializeTSS(int cpu) {
+    auto& gdt = gdts[cpu];
+    auto& tss = tsss[cpu];
+
+    const int kISTFrames = 8;
+    auto stack = memory_manager->Allocate(kISTFrames);
+    if (stack.error) {
+        Log(kError, "failed to allocate an interrupt stack: %s\n", stack.error.Name());
+        exit(1);
+    }
+    const uint64_t stack_end = reinterpret_cast<uint64_t>(stack.value.Frame()) + kISTFrames * kBytesPerFrame;
+
+    // ISTn is at offset 0x1c + 8 * n
+    tss[7 + 2 * kISTForFault] = stack_end & 0xffffffffu;
+    tss[8 + 2 * kISTForFault] = stack_end >> 32;
+
+    const uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
+    SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
+                     tss_addr & 0xffffffffu, sizeof(tss) - 1);
+    gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+
+    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+    LoadTR(kTSS);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <array>
 
+#include "smp.hpp"
 #include "x86_descriptor.hpp"
 
 union SegmentDescriptor {
@@ -37,8 +38,23 @@ void SetDataSegment(
     uint32_t base,
     uint32_t limit);
 
+void SetSystemSegment(
+    SegmentDescriptor& desc,
+    DescriptorType type,
+    unsigned int descriptor_privilege_level,
+    uint32_t base,
+    uint32_t limit);
+
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
+const uint16_t kTSS = 3 << 3;
+
+// Interrupt stack table index of the stack for #PF and #DF. Faults on an
+// overflowed task stack cannot push their frames onto it.
+const int kISTForFault = 1;
 
-void InitializeSegmentation();
+// Each processor has its own GDT and TSS, indexed by CurrentCPUIndex()
+void InitializeSegmentation(int cpu = 0);
+// Needs the memory manager to allocate the interrupt stacks
+void InitializeTSS(int cpu = 0);
@@ -0,0 +1,55 @@
+#include "slab.hpp"
+
+#include <cstdint>
+
+#include "logger.hpp"
+
+void* SlabCache::Allocate() {
+    SpinLockGuard guard{lock_};
+    if (free_list_ == nullptr && !Grow()) {
+        Log(kError, "SlabCache(%s): no memory for a new slab\n", name_);
+        return nullptr;
+    }
+
+    auto obj = free_list_;
+    free_list_ = obj->next;
+
+    --stats_.objects_free;
+    ++stats_.objects_in_use;
+    ++stats_.total_allocations;
+    return obj;
+}
+
+void SlabCache::Free(void* obj) {
+    if (obj == nullptr) return;
+
+    SpinLockGuard guard{lock_};
+    auto free_obj = reinterpret_cast<FreeObject*>(obj);
+    free_obj->next = free_list_;
+    free_list_ = free_obj;
+
+    --stats_.objects_in_use;
+    ++stats_.objects_free;
+}
+
+SlabCache::Stats SlabCache::GetStats() const {
+    SpinLockGuard guard{lock_};
+    return stats_;
+}
+
+bool SlabCache::Grow() {
+    const auto frame = memory_manager->Allocate(frames_per_slab_);
+    if (frame.error) return false;
+
+    const auto slab_begin = reinterpret_cast<uintptr_t>(frame.value.Frame());
+    const auto slab_end = slab_begin + frames_per_slab_ * kBytesPerFrame;
+    for (auto p = slab_begin; p + object_bytes_ <= slab_end; p += object_bytes_) {
+        auto obj = reinterpret_cast<FreeObject*>(p);
+        obj->next = free_list_;
+        free_list_ = obj;
+        ++stats_.objects_free;
+    }
+
+    ++stats_.slabs;
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+const size_t kCacheLineBytes = 64;
+
+/**
+ * Object cache of a single object size. Objects are carved from slabs of
+ * frames taken from the memory manager and are aligned to cache lines.
+ * Allocate and Free are O(1). Slabs are kept by the cache once allocated.
+ */
+class SlabCache {
+public:
+    struct Stats {
+        size_t object_bytes;
+        size_t slabs;
+        size_t objects_in_use;
+        size_t objects_free;
+        size_t total_allocations;
+    };
+
+    // Usable for global caches since the kernel does not run global constructors
+    constexpr SlabCache(const char* name, size_t object_size)
+      : name_{name},
+        object_bytes_{(object_size + kCacheLineBytes - 1) / kCacheLineBytes * kCacheLineBytes},
+        frames_per_slab_{
+            (object_bytes_ * kMinObjectsPerSlab + kBytesPerFrame - 1) / kBytesPerFrame},
+        stats_{object_bytes_, 0, 0, 0, 0}
+    {}
+
+    void* Allocate();
+    void Free(void* obj);
+
+    const char* Name() const { return name_; }
+    // A copy taken under the lock, so it is consistent
+    Stats GetStats() const;
+
+private:
+    struct FreeObject {
+        FreeObject* next;
+    };
+
+    static const size_t kMinObjectsPerSlab = 8;
+
+    const char* name_;
+    size_t object_bytes_;
+    size_t frames_per_slab_;
+    FreeObject* free_list_{nullptr};
+    Stats stats_;
+    mutable SpinLock lock_;
+
+    bool Grow();
+};
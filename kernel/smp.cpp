@@ -0,0 +1,138 @@
+#include "smp.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "stack.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern "C" {
+    // Read by the startup code of the application processor being started
+    uint64_t ap_boot_cr3;
+    uint64_t ap_boot_stack_top;
+    // CPU index of each local APIC ID, also read by the #NM handler. IDs not
+    // started map to the bootstrap processor.
+    uint8_t cpu_index_of_apic[256];
+
+    void ApMain();
+}
+
+namespace {
+    volatile uint32_t& local_apic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+    volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+    volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+    const uint32_t kICRDeliveryPending = 1u << 12;
+    const uint32_t kICRInit = 0x00004500; // INIT, level assert
+    const uint32_t kICRStartup = 0x00004600; // Start-up, level assert
+
+    // The boot stack becomes the stack of the idle task of the processor
+    const size_t kAPBootStackBytes = 16 * 1024;
+
+    std::array<uint8_t, kMaxCPUs> apic_id_of_cpu{};
+    int num_cpus = 1;
+    volatile bool ap_started;
+
+    uint8_t LocalAPICID() {
+        return local_apic_id >> 24;
+    }
+
+    void SendIPI(uint8_t apic_id, uint32_t command) {
+        icr_high = static_cast<uint32_t>(apic_id) << 24;
+        icr_low = command;
+        while (icr_low & kICRDeliveryPending) __builtin_ia32_pause();
+    }
+
+    // INIT-SIPI-SIPI sequence. The startup code must be at trampoline.
+    bool StartAP(uint8_t apic_id, int cpu, FrameID trampoline) {
+        void* stack = AllocStack(kAPBootStackBytes);
+        if (stack == nullptr) {
+            Log(kError, "failed to allocate a boot stack for APIC ID %u\n", apic_id);
+            return false;
+        }
+        ap_boot_stack_top = reinterpret_cast<uint64_t>(stack) + kAPBootStackBytes;
+        cpu_index_of_apic[apic_id] = cpu;
+        apic_id_of_cpu[cpu] = apic_id;
+        ap_started = false;
+
+        SendIPI(apic_id, kICRInit);
+        acpi::WaitMilliseconds(10);
+        // A processor which already left the wait-for-SIPI state ignores the second one
+        for (int i = 0; i < 2 && !ap_started; ++i) {
+            SendIPI(apic_id, kICRStartup | static_cast<uint32_t>(trampoline.ID()));
+            acpi::WaitMilliseconds(1);
+        }
+        for (int i = 0; i < 100 && !ap_started; ++i) {
+            acpi::WaitMilliseconds(1);
+        }
+        return ap_started;
+    }
+}
+
+int CurrentCPUIndex() {
+    return cpu_index_of_apic[LocalAPICID()];
+}
+
+int NumCPUs() {
+    return __atomic_load_n(&num_cpus, __ATOMIC_RELAXED);
+}
+
+void SendRescheduleIPI(int cpu) {
+    // Fixed delivery mode, edge triggered
+    SendIPI(apic_id_of_cpu[cpu], InterruptVector::kReschedule);
+}
+
+// Called by the startup code in 64-bit mode with interrupts masked
+extern "C" void ApMain() {
+    const int cpu = CurrentCPUIndex();
+    InitializeSegmentation(cpu);
+    InitializeTSS(cpu);
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeAPPaging();
+    InitializeFPU();
+    InitializeAPLAPICTimer();
+
+    ap_started = true;
+    task_manager->RunAsIdle();
+}
+
+void InitializeSMP() {
+    apic_id_of_cpu[0] = LocalAPICID();
+    if (acpi::madt == nullptr) {
+        Log(kWarn, "MADT is not found. Application processors are not started\n");
+        return;
+    }
+
+    const auto trampoline = LowMemoryFrame();
+    if (trampoline.ID() == kNullFrame.ID()) {
+        Log(kWarn, "no frame below 1 MiB. Application processors are not started\n");
+        return;
+    }
+    memcpy(trampoline.Frame(), ApTrampoline, ApTrampolineEnd - ApTrampoline);
+    // The startup code loads CR3 in 32-bit mode, so the PML4 must be below 4 GiB
+    ap_boot_cr3 = GetCR3() & 0xfffff000u;
+
+    std::array<uint8_t, 256> apic_ids;
+    const size_t num_apic_ids = acpi::madt->LocalAPICIDs(apic_ids.data(), apic_ids.size());
+    const uint8_t bsp_apic_id = apic_id_of_cpu[0];
+    for (size_t i = 0; i < num_apic_ids && num_cpus < kMaxCPUs; ++i) {
+        if (apic_ids[i] == bsp_apic_id) continue;
+
+        // A processor starting late would share the boot stack of the next one
+        if (!StartAP(apic_ids[i], num_cpus, trampoline)) {
+            Log(kWarn, "processor with APIC ID %u did not start\n", apic_ids[i]);
+            break;
+        }
+        __atomic_store_n(&num_cpus, num_cpus + 1, __ATOMIC_RELAXED);
+    }
+    Log(kInfo, "%d processors are running\n", num_cpus);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+// Upper limit of processors brought up by InitializeSMP
+const int kMaxCPUs = 16;
+
+/**
+ * Index of the processor executing the caller. The bootstrap processor is
+ * 0 and application processors are numbered from 1 in the order they start.
+ */
+int CurrentCPUIndex();
+// Number of processors running, including the bootstrap processor
+int NumCPUs();
+
+/**
+ * Interrupt processor cpu so that it switches to the highest level task
+ * queued for it. Can be called with interrupts masked.
+ */
+void SendRescheduleIPI(int cpu);
+
+/**
+ * Start the application processors listed in the MADT. Each of them sets
+ * up its own GDT, TSS and local APIC timer and runs its own idle task.
+ * Needs ACPI, the LAPIC timer and the task manager to be initialized.
+ */
+void InitializeSMP();
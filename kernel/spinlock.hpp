@@ -0,0 +1,41 @@
+#pragma once
+
+#include "interrupt.hpp"
+
+/**
+ * A test-and-set lock shared between processors. It does not mask
+ * interrupts by itself; use SpinLockGuard for data which interrupt handlers
+ * also touch, or a processor could spin on a lock it already holds.
+ */
+class SpinLock {
+public:
+    constexpr SpinLock() = default;
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    void Lock() {
+        while (__atomic_exchange_n(&locked_, true, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) {
+                __builtin_ia32_pause();
+            }
+        }
+    }
+    void Unlock() { __atomic_store_n(&locked_, false, __ATOMIC_RELEASE); }
+
+private:
+    bool locked_{false};
+};
+
+// Masks interrupts and holds the lock during its lifetime
+class SpinLockGuard {
+public:
+    explicit SpinLockGuard(SpinLock& lock) : lock_{lock} { lock_.Lock(); }
+    ~SpinLockGuard() { lock_.Unlock(); }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+private:
+    // Declared first so that interrupts are masked before the lock is taken
+    InterruptGuard interrupt_guard_;
+    SpinLock& lock_;
+};
@@ -0,0 +1,81 @@
+#include "stack.hpp"
+
+#include <array>
+
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+namespace {
+
+// Link of a pooled stack, stored at its lowest address
+struct PooledStack {
+    PooledStack* next;
+};
+
+// Stacks and their guard pages are carved from this region and never unmapped
+const uintptr_t kStackRegionBase = 0xffffc00000000000;
+const size_t kStackRegionBytes = 64ul * 1024 * 1024 * 1024;
+// The largest stack has 2^kMaxStackOrder pages (1 MiB)
+const unsigned int kMaxStackOrder = 8;
+
+SpinLock stack_lock;
+uintptr_t stack_region_end = kStackRegionBase;
+std::array<PooledStack*, kMaxStackOrder + 1> pools{};
+
+unsigned int StackOrder(size_t bytes) {
+    unsigned int order = 0;
+    while ((kBytesPerFrame << order) < bytes) ++order;
+    return order;
+}
+
+void* MapNewStack(unsigned int order) {
+    const size_t num_pages = static_cast<size_t>(1) << order;
+    const uintptr_t stack = stack_region_end + kBytesPerFrame; // above the guard page
+    if (stack + num_pages * kBytesPerFrame > kStackRegionBase + kStackRegionBytes) {
+        return nullptr;
+    }
+
+    const auto frame = memory_manager->Allocate(num_pages);
+    if (frame.error) return nullptr;
+    if (kernel_page_map->Map(stack, reinterpret_cast<uint64_t>(frame.value.Frame()),
+                             num_pages * kBytesPerFrame, kPageWritable)) {
+        kernel_page_map->Unmap(stack, num_pages * kBytesPerFrame);
+        kernel_page_map->Flush();
+        memory_manager->Free(frame.value, num_pages);
+        return nullptr;
+    }
+
+    stack_region_end = stack + num_pages * kBytesPerFrame;
+    return reinterpret_cast<void*>(stack);
+}
+
+}
+
+void* AllocStack(size_t bytes) {
+    const auto order = StackOrder(bytes);
+    if (order > kMaxStackOrder) return nullptr;
+
+    SpinLockGuard guard{stack_lock};
+    if (auto stack = pools[order]) {
+        pools[order] = stack->next;
+        return stack;
+    }
+    return MapNewStack(order);
+}
+
+void FreeStack(void* stack, size_t bytes) {
+    const auto order = StackOrder(bytes);
+    SpinLockGuard guard{stack_lock};
+    auto pooled = reinterpret_cast<PooledStack*>(stack);
+    pooled->next = pools[order];
+    pools[order] = pooled;
+}
+
+size_t StackBytes(size_t bytes) {
+    return kBytesPerFrame << StackOrder(bytes);
+}
+
+bool IsStackGuardAddress(uint64_t addr) {
+    return kStackRegionBase <= addr && addr < kStackRegionBase + kStackRegionBytes;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Allocate a stack of at least bytes, rounded up to a power of two of pages,
+ * and returns its lowest address. The page right below the stack is never
+ * mapped, so an overflow faults instead of corrupting other memory.
+ * Freed stacks stay mapped in a pool and are handed out again for the same size.
+ * Returns nullptr when no memory is left.
+ */
+void* AllocStack(size_t bytes);
+
+/**
+ * Return a stack allocated by AllocStack with the same bytes to the pool.
+ */
+void FreeStack(void* stack, size_t bytes);
+
+/**
+ * Bytes AllocStack actually reserves for a request of bytes.
+ */
+size_t StackBytes(size_t bytes);
+
+/**
+ * true if addr is in the region of stacks. Every page there is mapped
+ * except for the guard pages, so a non-present fault on it is an overflow.
+ */
+bool IsStackGuardAddress(uint64_t addr);
@@ -1,39 +1,72 @@
 #include "task.hpp"
 
+#include <algorithm>
+
 #include "asmfunc.h"
+#include "clock.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
+#include "stack.hpp"
 #include "timer.hpp"
 
 namespace {
-    template <class T, class U>
-    void Erase(T& c, const U& value) {
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
-    }
+    SlabCache task_cache{"Task", sizeof(Task)};
 
+    // Zeroes free frames in the background while there is nothing else to run
     void TaskIdle(uint64_t task_id, int64_t data) {
-        while(true) __asm__("hlt");
+        while(true) {
+            if (!memory_manager->FillZeroedPool()) __asm__("hlt");
+        }
     }
 }
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {}
+void* Task::operator new(size_t size) {
+    if (auto p = task_cache.Allocate()) return p;
+    Log(kError, "failed to allocate a task\n");
+    exit(1);
+}
+
+void Task::operator delete(void* p) {
+    task_cache.Free(p);
+}
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+Task::Task(uint64_t id) : id_{id} {
+    InitFPUArea(fpu_area_.data());
+}
+
+Task::~Task() {
+    if (stack_) FreeStack(stack_, stack_bytes_);
+}
+
+Task& Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+    stack_bytes = StackBytes(stack_bytes);
+    if (stack_ && stack_bytes_ != stack_bytes) {
+        FreeStack(stack_, stack_bytes_);
+        stack_ = nullptr;
+    }
+    if (!stack_) {
+        stack_ = AllocStack(stack_bytes);
+        if (!stack_) {
+            Log(kError, "failed to allocate a stack of %lu bytes\n", stack_bytes);
+            exit(1);
+        }
+        stack_bytes_ = stack_bytes;
+    }
+    uint64_t stack_end = reinterpret_cast<uint64_t>(stack_) + stack_bytes_;
 
     memset(&context_, 0, sizeof(context_));
-    context_.cr3 = GetCR3();
-    context_.rflags = 0x202;
+    context_.cr3 = MakeCR3(reinterpret_cast<uint64_t>(kernel_page_map->PML4()), kKernelPCID);
+    context_.rflags = 0x2; // StartTask enables interrupts
     context_.cs = kKernelCS;
     context_.ss = kKernelSS;
     context_.rsp = (stack_end & ~0xflu) - 8;
-    context_.rip = reinterpret_cast<uint64_t>(f);
+    context_.rip = reinterpret_cast<uint64_t>(TaskManager::StartTask);
     context_.rdi = id_;
     context_.rsi = data;
-
-    *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
+    context_.rdx = reinterpret_cast<uint64_t>(f);
     return *this;
 }
 
@@ -48,88 +81,309 @@ Task& Task::Wakeup() {
     return *this;
 }
 
-void Task::SendMessage(const Message& msg) {
-    msgs_.push_back(msg);
-    Wakeup();
+Task& Task::SleepFor(uint64_t nsec) {
+    return SleepUntil(NowNanoseconds() + nsec);
+}
+
+Task& Task::SleepUntil(uint64_t deadline_ns) {
+    // CurrentTick is rounded down, so the timer may expire up to a tick
+    // before the deadline. The remainder is slept again.
+    for (uint64_t now = NowNanoseconds(); now < deadline_ns; now = NowNanoseconds()) {
+        // The timer lives on this task's stack until it expires
+        Timer timer{timer_manager->CurrentTick() + NanosecondsToTicks(deadline_ns - now),
+                    kTaskWakeupTimerValue, id_};
+        timer_manager->AddTimer(timer);
+        task_manager->SleepOnTimer(this, timer);
+    }
+    return *this;
+}
+
+Error Task::SendMessage(const Message& msg) {
+    if (!msgs_.Push(msg)) {
+        return MAKE_ERROR(Error::kFull);
+    }
+    // Pairs with the fence in SleepOnMessages: either the receiver sees the
+    // message before sleeping or this sees it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&waiting_messages_, false, __ATOMIC_RELAXED)) {
+        task_manager->WakeupBlocked(this);
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-    if (msgs_.empty()) { return std::nullopt; }
-    auto m = msgs_.front();
-    msgs_.pop_front();
+    Message m;
+    if (!msgs_.Pop(m)) { return std::nullopt; }
     return m;
 }
 
+size_t Task::ReceiveMessages(Message* buf, size_t max) {
+    size_t n = 0;
+    bool has_xhci = false;
+    Message m;
+    while (n < max && msgs_.Pop(m)) {
+        if (m.type == Message::kInterruptXHCI) {
+            // A single ProcessEvents call drains the whole event ring
+            if (has_xhci) continue;
+            has_xhci = true;
+        } else if (m.type == Message::kMouseMove && n > 0) {
+            auto& last = buf[n - 1];
+            if (last.type == Message::kMouseMove && last.arg.mouse.buttons == m.arg.mouse.buttons) {
+                last.arg.mouse.displacement_x += m.arg.mouse.displacement_x;
+                last.arg.mouse.displacement_y += m.arg.mouse.displacement_y;
+                continue;
+            }
+        }
+        buf[n++] = m;
+    }
+    return n;
+}
+
+Task& Task::SleepUntilMessage() {
+    task_manager->SleepOnMessages(this);
+    return *this;
+}
+
+void RunQueue::PushBack(Task* task) {
+    task->run_prev_ = tail_;
+    task->run_next_ = nullptr;
+    if (tail_) {
+        tail_->run_next_ = task;
+    } else {
+        head_ = task;
+    }
+    tail_ = task;
+}
+
+void RunQueue::PopFront() {
+    Remove(head_);
+}
+
+void RunQueue::Remove(Task* task) {
+    if (task->run_prev_) {
+        task->run_prev_->run_next_ = task->run_next_;
+    } else {
+        head_ = task->run_next_;
+    }
+    if (task->run_next_) {
+        task->run_next_->run_prev_ = task->run_prev_;
+    } else {
+        tail_ = task->run_prev_;
+    }
+    task->run_prev_ = task->run_next_ = nullptr;
+}
+
 TaskManager::TaskManager() {
+    tasks_capacity_ = 16;
+    tasks_ = new Task*[tasks_capacity_]{};
+    num_tasks_ = 1;
+
+    // The caller becomes the main task
     Task& task = NewTask()
-        .SetLevel(current_level_)
+        .SetLevel(kMaxLevel)
         .SetRunning(true);
-    running_[current_level_].push_back(&task);
+    task.on_cpu_ = true;
+    cpus_[0].current = &task;
+    fpu_owners[0] = {task.fpu_area_.data(), task.fpu_area_.data()};
 
     Task& idle = NewTask()
         .InitContext(TaskIdle, 0)
         .SetLevel(0)
         .SetRunning(true);
-    running_[0].push_back(&idle);
+    cpus_[0].idle = &idle;
+    Enqueue(&idle);
 }
 
 Task& TaskManager::NewTask() {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
-}
+    SpinLockGuard guard{lock_};
+    if (num_tasks_ == tasks_capacity_) {
+        // FindTask may still be reading the old table on another processor
+        Task** tasks = new Task*[2 * tasks_capacity_]{};
+        std::copy_n(tasks_, num_tasks_, tasks);
+        __atomic_store_n(&tasks_, tasks, __ATOMIC_RELEASE);
+        tasks_capacity_ *= 2;
+    }
 
-void TaskManager::SwitchTask(bool current_sleep) {
-    auto& level_queue = running_[current_level_];
-    Task* current_task = level_queue.front();
-    level_queue.pop_front();
+    const uint64_t id = num_tasks_;
+    Task* task = new Task{id};
+    task->cpu_ = CurrentCPUIndex();
+    tasks_[id] = task;
+    __atomic_store_n(&num_tasks_, id + 1, __ATOMIC_RELEASE);
+    return *task;
+}
 
-    if (!current_sleep) {
-        level_queue.push_back(current_task);
-    }
-    if (level_queue.empty()) {
-        level_changed_ = true;
-    }
+void TaskManager::SwitchTask() {
+    SpinLockGuard guard{lock_};
+    SwitchTaskLocked();
+}
 
-    if (level_changed_) {
-        level_changed_ = false;
-        for (int lv = kMaxLevel; lv >= 0; --lv) if (!running_[lv].empty()) {
-            current_level_ = lv;
-            break;
-        }
+void TaskManager::RunAsIdle() {
+    Task& idle = NewTask()
+        .SetLevel(0)
+        .SetRunning(true);
+    {
+        SpinLockGuard guard{lock_};
+        idle.on_cpu_ = true;
+        cpus_[idle.cpu_].current = &idle;
+        cpus_[idle.cpu_].idle = &idle;
+        fpu_owners[idle.cpu_] = {idle.fpu_area_.data(), idle.fpu_area_.data()};
     }
 
-    Task* next_task = running_[current_level_].front();
-
-    SwitchContext(&next_task->Context(), &current_task->Context());
+    __asm__("sti");
+    TaskIdle(idle.ID(), 0);
 }
 
 void TaskManager::Sleep(Task* task) {
+    SpinLockGuard guard{lock_};
+    // A task blocked on a timer or messages stays asleep past the event
+    task->suspended_ = true;
     if (!task->Running()) { return; }
 
     task->SetRunning(false);
 
-    if (task == running_[current_level_].front()) {
-        SwitchTask(true);
+    if (task == cpus_[CurrentCPUIndex()].current) {
+        SwitchTaskLocked();
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    // A task executed by another processor leaves it at its next task switch
+    if (!task->on_cpu_) {
+        Dequeue(task);
+    }
+}
+
+void TaskManager::SleepOnTimer(Task* task, const Timer& timer) {
+    SpinLockGuard guard{lock_};
+    // Tick clears Pending before it takes lock_ to wake the task up, so
+    // the wakeup cannot be missed
+    while (timer.Pending() || task->suspended_) {
+        task->SetRunning(false);
+        SwitchTaskLocked();
+    }
 }
 
-Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) {
-        return t->ID() == id;
-    });
+void TaskManager::SleepOnMessages(Task* task) {
+    SpinLockGuard guard{lock_};
+    for (;;) {
+        __atomic_store_n(&task->waiting_messages_, true, __ATOMIC_RELAXED);
+        // Pairs with the fence in Task::SendMessage. A sender that sees the
+        // flag wakes the task through lock_, so after SetRunning(false).
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (task->msgs_.Ready() && !task->suspended_) {
+            break;
+        }
+        task->SetRunning(false);
+        SwitchTaskLocked();
+    }
+    __atomic_store_n(&task->waiting_messages_, false, __ATOMIC_RELAXED);
+}
 
-    if (it == tasks_.end()) {
+Error TaskManager::Sleep(uint64_t id) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    Sleep(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+    SpinLockGuard guard{lock_};
+    task->suspended_ = false;
+    WakeupLocked(task, level);
+}
+
+Error TaskManager::Wakeup(uint64_t id, int level) {
+    SpinLockGuard guard{lock_};
+    Task* task = FindTask(id);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+
+    task->suspended_ = false;
+    WakeupLocked(task, level);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::WakeupBlocked(Task* task) {
+    SpinLockGuard guard{lock_};
+    if (!task->suspended_) {
+        WakeupLocked(task, -1);
+    }
+}
+
+Error TaskManager::WakeupBlocked(uint64_t id) {
+    SpinLockGuard guard{lock_};
+    Task* task = FindTask(id);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+
+    if (!task->suspended_) {
+        WakeupLocked(task, -1);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+
+    return task->SendMessage(msg);
+}
+
+Task& TaskManager::CurrentTask() {
+    // The lock keeps the caller on this processor until current is read
+    SpinLockGuard guard{lock_};
+    return *cpus_[CurrentCPUIndex()].current;
+}
+
+Task& TaskManager::CurrentTaskUnlocked() {
+    // Only this processor changes its current task, which it cannot do
+    // while interrupts are masked
+    return *__atomic_load_n(&cpus_[CurrentCPUIndex()].current, __ATOMIC_RELAXED);
+}
+
+size_t TaskManager::MemoryBytes() const {
+    const auto stats = task_cache.GetStats();
+    SpinLockGuard guard{lock_};
+    size_t bytes = stats.object_bytes * (stats.objects_in_use + stats.objects_free);
+    for (size_t id = 1; id < num_tasks_; ++id) {
+        bytes += tasks_[id]->stack_bytes_;
+    }
+    return bytes;
+}
+
+void TaskManager::SwitchTaskLocked() {
+    const int cpu = CurrentCPUIndex();
+    auto& queues = cpus_[cpu];
+    Task* current_task = queues.current;
+    if (current_task->Running()) {
+        Enqueue(current_task);
+    }
+
+    // Only the idle task is left at level 0
+    if (HighestReadyLevel(cpu) == 0) {
+        StealTask(cpu);
+    }
+
+    Task* next_task = queues.running[HighestReadyLevel(cpu)].Front();
+    Dequeue(next_task);
+    current_task->on_cpu_ = false;
+    next_task->on_cpu_ = true;
+    queues.current = next_task;
+    fpu_owners[cpu].current_area = next_task->fpu_area_.data();
+    UpdateTimeSlicing(cpu);
+
+    if (next_task != current_task) {
+        SwitchContext(&next_task->Context(), &current_task->Context());
+    }
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
     if (task->Running()) {
         ChangeLevelRunning(task, level);
         return;
@@ -141,75 +395,155 @@ void TaskManager::Wakeup(Task* task, int level) {
 
     task->SetLevel(level);
     task->SetRunning(true);
-
-    running_[level].push_back(task);
-    if (level > current_level_) {
-        level_changed_ = true;
+    // A task put to sleep while still being executed was never dequeued.
+    // A task woken at a higher level runs from the next SwitchTask.
+    if (!task->on_cpu_) {
+        Enqueue(task);
+        UpdateTimeSlicing(task->cpu_);
     }
-
-    return;
 }
 
-Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) {
-        return t->ID() == id;
-    });
+void TaskManager::ChangeLevelRunning(Task* task, int level) {
+    if (level < 0 || level == task->Level()) { return; }
 
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+    // The current task of a processor is queued with its new level at the
+    // next task switch
+    if (task->on_cpu_) {
+        task->SetLevel(level);
+        return;
     }
 
-    Wakeup(it->get(), level);
-    return MAKE_ERROR(Error::kSuccess);
+    Dequeue(task);
+    task->SetLevel(level);
+    Enqueue(task);
+    UpdateTimeSlicing(task->cpu_);
 }
 
-Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [id](const auto& t) {
-        return t->ID() == id;
-    });
-
-    if (it == tasks_.end()) {
-        return MAKE_ERROR(Error::kNoSuchTask);
+Task* TaskManager::FindTask(uint64_t id) const {
+    // num_tasks_ is published after the table holding the task
+    if (id >= __atomic_load_n(&num_tasks_, __ATOMIC_ACQUIRE)) {
+        return nullptr;
     }
+    return __atomic_load_n(&tasks_, __ATOMIC_ACQUIRE)[id];
+}
 
-    (*it)->SendMessage(msg);
-    return MAKE_ERROR(Error::kSuccess);
+void TaskManager::Enqueue(Task* task) {
+    auto& queues = cpus_[task->cpu_];
+    queues.running[task->Level()].PushBack(task);
+    queues.ready_levels |= 1ul << task->Level();
 }
 
-Task& TaskManager::CurrentTask() { return *running_[current_level_].front(); }
+void TaskManager::Dequeue(Task* task) {
+    auto& queues = cpus_[task->cpu_];
+    auto& queue = queues.running[task->Level()];
+    queue.Remove(task);
+    if (queue.Empty()) {
+        queues.ready_levels &= ~(1ul << task->Level());
+    }
+}
 
-void TaskManager::ChangeLevelRunning(Task* task, int level) {
-    if (level < 0 || level == task->Level()) { return; }
+int TaskManager::HighestReadyLevel(int cpu) const {
+    // ready_levels must not be 0. SwitchTaskLocked queues the current task
+    // before asking, and the idle task is queued unless it is current.
+    return 63 - __builtin_clzl(cpus_[cpu].ready_levels);
+}
 
-    if (task != running_[current_level_].front()) {
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
-        task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
+bool TaskManager::StealTask(int cpu) {
+    for (int victim = 0; victim < NumCPUs(); ++victim) {
+        if (victim == cpu) continue;
+
+        auto& queues = cpus_[victim];
+        // Pairs with the store of the #NM handler after it saved the registers
+        const void* fpu_owner_area =
+            __atomic_load_n(&fpu_owners[victim].owner_area, __ATOMIC_ACQUIRE);
+        for (int level = kMaxLevel; level > 0; --level) {
+            // Tasks at the back waited the shortest on the victim
+            for (Task* task = queues.running[level].Back(); task; task = task->run_prev_) {
+                // The FPU state of the owner is still in the victim's registers
+                if (!task->migratable_ || task->fpu_area_.data() == fpu_owner_area) continue;
+
+                Dequeue(task);
+                task->cpu_ = cpu;
+                Enqueue(task);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void TaskManager::UpdateTimeSlicing(int cpu) {
+    const auto& queues = cpus_[cpu];
+    if (cpu != 0) {
+        // Application processors keep a periodic tick, which also lets them
+        // steal work. One that is idle or runs a lower level task is
+        // interrupted to switch now rather than at its next tick.
+        if (cpu != CurrentCPUIndex() && queues.ready_levels != 0
+            && (queues.current == queues.idle
+                || HighestReadyLevel(cpu) > queues.current->Level())) {
+            SendRescheduleIPI(cpu);
         }
         return;
     }
 
-    running_[current_level_].pop_front();
-    running_[level].push_back(task);
-    task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
-    } else {
-        current_level_ = level;
-        level_changed_ = true;
+    const bool contended = queues.ready_levels != 0
+        && HighestReadyLevel(cpu) >= queues.current->Level();
+    if (CurrentCPUIndex() != 0) {
+        // The bootstrap processor may be idle with no timeout armed, so
+        // it is interrupted to pick up the task queued for it
+        if (contended) {
+            SendRescheduleIPI(cpu);
+        }
+        return;
     }
+    timer_manager->SetTimeSlicing(contended);
+}
+
+void TaskManager::StartTask(uint64_t task_id, int64_t data, TaskFunc* f) {
+    task_manager->lock_.Unlock();
+    __asm__("sti");
+    f(task_id, data);
 }
 
 TaskManager* task_manager;
 
 void InitializeTask() {
+    // The task timer is armed by the scheduler when tasks contend
     task_manager = new TaskManager;
+}
 
-    __asm__("cli");
-    timer_manager->AddTimer(
-        Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue}
-    );
-    __asm__("sti");
+namespace {
+    // Only the processor itself touches its entry, with interrupts masked
+    struct Preemption {
+        int disable_count;
+        bool pending;
+    };
+    std::array<Preemption, kMaxCPUs> preemption{};
+}
+
+void DisablePreemption() {
+    InterruptGuard guard;
+    ++preemption[CurrentCPUIndex()].disable_count;
+}
+
+void EnablePreemption() {
+    bool pending;
+    {
+        InterruptGuard guard;
+        auto& p = preemption[CurrentCPUIndex()];
+        pending = --p.disable_count == 0 && p.pending;
+        if (pending) p.pending = false;
+    }
+    if (pending) {
+        task_manager->SwitchTask();
+    }
+}
+
+void PreemptFromInterrupt() {
+    auto& p = preemption[CurrentCPUIndex()];
+    if (p.disable_count > 0) {
+        p.pending = true;
+        return;
+    }
+    task_manager->SwitchTask();
 }
@@ -3,78 +3,231 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
-#include <deque>
 #include <optional>
-#include <vector>
 
 #include "error.hpp"
+#include "fpu.hpp"
 #include "message.hpp"
+#include "mpsc_queue.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "timer.hpp"
 
 struct TaskContext {
     uint64_t cr3, rip, rflags, reserved1; // offset 0x00
     uint64_t cs, ss, fs, gs; // offset 0x20
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
     uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
-    std::array<uint8_t, 512> fxsave_area; // offset 0xc0
 } __attribute__((packed));
 
 using TaskFunc = void (uint64_t, int64_t);
 
+class Task;
+
+// FIFO of tasks linked through the tasks themselves. All operations are O(1)
+// and never allocate, so they are safe in the timer interrupt.
+class RunQueue {
+public:
+    bool Empty() const { return head_ == nullptr; }
+    Task* Front() const { return head_; }
+    Task* Back() const { return tail_; }
+    void PushBack(Task* task);
+    void PopFront();
+    void Remove(Task* task);
+private:
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
+};
+
 class Task {
 public:
     static const int kDefaultLevel = 1;
-    static const size_t kDefaultStackBytes = 4096;
+    static const size_t kDefaultStackBytes = 16 * 1024;
+    // Messages sent while this many are queued are dropped
+    static const size_t kMessageQueueCapacity = 128;
+
+    // Tasks are allocated from a dedicated slab cache
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
 
     Task(uint64_t id);
-    Task& InitContext(TaskFunc* f, int64_t data);
+    ~Task();
+    // The stack is taken from the stack pool and has a guard page below it
+    Task& InitContext(TaskFunc* f, int64_t data, size_t stack_bytes = kDefaultStackBytes);
     TaskContext& Context();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
-    void SendMessage(const Message& msg);
+    // Block the calling task, which must be this one, until the clock
+    // (NowNanoseconds) passes the time. Timeouts are rounded up to the tick
+    // of timer_manager.
+    Task& SleepFor(uint64_t nsec);
+    Task& SleepUntil(uint64_t deadline_ns);
+    // Any task, processor or interrupt handler may send. Returns kFull when
+    // the message is dropped.
+    Error SendMessage(const Message& msg);
+    // Only the task itself receives its messages
     std::optional<Message> ReceiveMessage();
+    // Moves up to max queued messages to buf and returns their number.
+    // Consecutive kMouseMove messages with the same buttons are merged, and
+    // a kInterruptXHCI already in buf absorbs later ones.
+    size_t ReceiveMessages(Message* buf, size_t max);
+    // Sleeps until a message arrives, unless one is already queued
+    Task& SleepUntilMessage();
+    uint64_t DroppedMessages() const { return msgs_.Drops(); }
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
+    // Lets idle processors take the task from the run queue of another
+    // processor. Tasks touching per-processor state must stay pinned.
+    Task& SetMigratable(bool migratable) { migratable_ = migratable; return *this; }
 private:
     uint64_t id_;
-    std::vector<uint64_t> stack_;
+    void* stack_{nullptr};
+    size_t stack_bytes_{0};
     alignas(16) TaskContext context_;
-    std::deque<Message> msgs_;
+    // Holds the FPU registers while another task owns them on this task's processor
+    alignas(64) std::array<uint8_t, kFPUAreaBytes> fpu_area_;
+    MPSCQueue<Message, kMessageQueueCapacity> msgs_;
     unsigned int level_{kDefaultLevel};
     bool running_{false};
+    // Set by TaskManager::Sleep; only an explicit Wakeup clears it
+    bool suspended_{false};
+    // Set while the task sleeps in SleepOnMessages, so that senders take the
+    // scheduler lock only to wake a task that waits for them
+    bool waiting_messages_{false};
+    // Index of the processor whose run queues hold the task
+    int cpu_{0};
+    // Set while a processor executes the task, which is then in no run queue
+    bool on_cpu_{false};
+    bool migratable_{false};
+    // Links of the run queue of level_ while running_ and not on_cpu_
+    Task* run_prev_{nullptr};
+    Task* run_next_{nullptr};
 
     Task& SetLevel(int level) { level_ = level; return *this; }
     Task& SetRunning(bool running) { running_ = running; return *this; }
 
+    friend class RunQueue;
     friend class TaskManager;
 };
 
+/**
+ * Schedules tasks on every processor. Each processor has its own run queues
+ * and picks from them; an idle processor takes a migratable task queued on
+ * another one. All scheduler state is guarded by one lock, which a task
+ * switch holds across SwitchContext and the resumed task releases.
+ */
 class TaskManager {
 public:
     // level: 0 = lowest, kMaxLevel = highest
     static const int kMaxLevel = 3;
+    static_assert(kMaxLevel < 64, "ready_levels has a bit per level");
 
     TaskManager();
+    // The new task belongs to the calling processor
     Task& NewTask();
-    void SwitchTask(bool current_sleep = false);
+    // Puts the current task back to its run queue, unless it sleeps, and
+    // switches to the first task of the highest ready level
+    void SwitchTask();
+    // Turns the caller into the idle task of an application processor
+    void RunAsIdle();
 
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
+    // Puts the current task to sleep until the timer is no longer pending.
+    // Other wakeups do not end the sleep.
+    void SleepOnTimer(Task* task, const Timer& timer);
+    // Puts the current task to sleep until its message queue is not empty
+    void SleepOnMessages(Task* task);
+    // Also ends a suspension by Sleep
     void Wakeup(Task* task, int level = -1);
     Error Wakeup(uint64_t id, int level = -1);
+    // Wakes a task for a timer or message event, unless Sleep suspended it
+    void WakeupBlocked(Task* task);
+    Error WakeupBlocked(uint64_t id);
     Error SendMessage(uint64_t id, const Message& msg);
     Task& CurrentTask();
+    // CurrentTask without the lock, for fault handlers which may have
+    // interrupted its holder. Interrupts must be masked.
+    Task& CurrentTaskUnlocked();
+    // Bytes held by task objects (slab frames) and their stacks
+    size_t MemoryBytes() const;
 private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{0};
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    int current_level_{kMaxLevel};
-    bool level_changed_{false};
+    struct CPUQueues {
+        std::array<RunQueue, kMaxLevel + 1> running{};
+        // Bit n is set while running[n] is not empty
+        uint64_t ready_levels{0};
+        Task* current{nullptr};
+        Task* idle{nullptr};
+    };
 
+    mutable SpinLock lock_;
+    // Indexed by task ID. Slot 0 is unused so that no task has ID 0, and
+    // the main task gets ID 1. Tasks never exit, so IDs are not reused.
+    // FindTask reads the table without lock_, so a full table is replaced
+    // by a larger copy and never freed.
+    Task** tasks_{nullptr};
+    size_t num_tasks_{0};
+    size_t tasks_capacity_{0};
+    std::array<CPUQueues, kMaxCPUs> cpus_{};
+
+    // The following need lock_ to be held
+    void SwitchTaskLocked();
+    void WakeupLocked(Task* task, int level);
     void ChangeLevelRunning(Task* task, int level);
+    void Enqueue(Task* task);
+    void Dequeue(Task* task);
+    int HighestReadyLevel(int cpu) const;
+    // Moves a migratable task queued on another processor to cpu
+    bool StealTask(int cpu);
+    // Turns the task timer of the bootstrap processor on while another task
+    // is ready to take over from its current task, and interrupts another
+    // processor that should switch to a task just queued for it
+    void UpdateTimeSlicing(int cpu);
+
+    // Safe without lock_ and from interrupt handlers
+    Task* FindTask(uint64_t id) const;
+
+    // Entry point of new tasks, which start with lock_ held by SwitchTask
+    static void StartTask(uint64_t task_id, int64_t data, TaskFunc* f);
+
+    friend class Task;
 };
 
 extern TaskManager* task_manager;
 
 void InitializeTask();
+
+/**
+ * Defer preemption of the calling task until the matching EnablePreemption.
+ * Calls nest. The timer and reschedule interrupts switch tasks through
+ * PreemptFromInterrupt, which leaves the switch to EnablePreemption while
+ * preemption is disabled.
+ */
+void DisablePreemption();
+void EnablePreemption();
+// Called with interrupts masked
+void PreemptFromInterrupt();
+
+/**
+ * Holds the lock with preemption disabled during its lifetime. Unlike
+ * SpinLockGuard it leaves interrupts enabled, so it suits long critical
+ * sections over data which interrupt handlers never touch.
+ */
+class TaskSpinLockGuard {
+public:
+    explicit TaskSpinLockGuard(SpinLock& lock) : lock_{lock} {
+        DisablePreemption();
+        lock_.Lock();
+    }
+    ~TaskSpinLockGuard() {
+        lock_.Unlock();
+        EnablePreemption();
+    }
+    TaskSpinLockGuard(const TaskSpinLockGuard&) = delete;
+    TaskSpinLockGuard& operator=(const TaskSpinLockGuard&) = delete;
+
+private:
+    SpinLock& lock_;
+};
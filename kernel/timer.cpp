@@ -1,9 +1,14 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
 #include <limits>
 
-#include "acpi.hpp"
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "hpet.hpp"
 #include "interrupt.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
@@ -13,25 +18,54 @@ volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
 volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
 volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
 volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+volatile uint32_t& spurious_interrupt_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+volatile uint32_t& local_apic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
 
 const uint32_t TIMER_FREQUENCY_RATE_PER_CPU_CLOCK_1 = 0b1011;
 const uint32_t INTERRUPT_LVT_TIMER_REG = 0b010 << 16;
+const uint32_t kLVTTimerOneShot = 0b000 << 16;
+const uint32_t kLVTTimerTSCDeadline = 0b100 << 16;
+const uint32_t kLVTMasked = 1u << 16;
+const uint32_t kAPICSoftwareEnable = 1u << 8;
+const uint32_t kICRSelf = 0b01 << 18; // Destination shorthand
+const uint32_t kICRDeliveryPending = 1u << 12;
 
-}
+const uint32_t kCPUIDTSCDeadline = 1u << 24; // CPUID.01H:ECX
+const uint32_t kMSRTSCDeadline = 0x6e0;
 
-void InitializeLAPICTimer() {
-    timer_manager = new TimerManager;
+// The bootstrap processor sleeps at most this long in tickless mode
+const unsigned long kMaxTicklessTicks = kTimerFreq;
+// The LAPIC timer runs at tens of MHz or more, measured by a clock with a
+// resolution of nanoseconds
+const uint64_t kLAPICCalibrationNanoseconds = 2000000;
 
-    divide_config = TIMER_FREQUENCY_RATE_PER_CPU_CLOCK_1;
-    lvt_timer = 0b001 << 16;
+enum class TimerMode {
+    kPeriodic,
+    kOneShot,
+    kTSCDeadline,
+    kHPET,
+};
 
-    StartLAPICTimer();
-    acpi::WaitMilliseconds(100);
-    const auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
+// Mode of the timer of the bootstrap processor. The tickless modes derive
+// the current tick from a counter: the invariant TSC, or the main counter of
+// the HPET whose comparator then replaces the LAPIC timer.
+TimerMode timer_mode = TimerMode::kPeriodic;
+uint64_t counter_base;
+uint64_t counter_per_tick;
+// The tick for which the bootstrap processor armed its timer
+unsigned long armed_tick;
+uint8_t bsp_apic_id;
+
+uint64_t ReadCounter() {
+    return timer_mode == TimerMode::kHPET ? HPETCounter() : __builtin_ia32_rdtsc();
+}
 
-    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+// Ticks of the timers of application processors, counted for task switches
+std::array<unsigned long, kMaxCPUs> ap_ticks{};
 
+void StartPeriodicTimer() {
     divide_config = TIMER_FREQUENCY_RATE_PER_CPU_CLOCK_1; // frequency rate = 1
     lvt_timer = INTERRUPT_LVT_TIMER_REG | InterruptVector::kLAPICTimer; // not-masked, periodic
     initial_count = lapic_timer_freq / kTimerFreq;
@@ -40,6 +74,7 @@ void InitializeLAPICTimer() {
 void StartLAPICTimer() {
     initial_count = kCountMax;
 }
+
 uint32_t LAPICTimerElapsed() {
     return kCountMax - current_count;
 }
@@ -48,50 +83,318 @@ void StopLAPICTimer() {
     initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value) : timeout_{timeout}, value_{value} {}
+TimerMode DetectTicklessMode() {
+    if (!TSCInvariant()) {
+        const uint8_t apic_id = local_apic_id >> 24;
+        return InitializeHPETOneShot(apic_id, InterruptVector::kLAPICTimer)
+            ? TimerMode::kHPET : TimerMode::kPeriodic;
+    }
 
-TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    return (ecx & kCPUIDTSCDeadline) ? TimerMode::kTSCDeadline : TimerMode::kOneShot;
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+// Requests an interrupt when the tick reaches timeout_tick, or right away
+// if it has passed
+void ArmOneShot(unsigned long timeout_tick) {
+    const uint64_t deadline = counter_base + timeout_tick * counter_per_tick;
+    if (timer_mode == TimerMode::kTSCDeadline) {
+        WriteMSR(kMSRTSCDeadline, deadline);
+        return;
+    }
+    if (timer_mode == TimerMode::kHPET) {
+        if (!HPETArmOneShot(deadline)) {
+            icr_low = kICRSelf | InterruptVector::kLAPICTimer;
+        }
+        return;
+    }
+
+    const uint64_t now_tsc = __builtin_ia32_rdtsc();
+    const uint64_t remaining_tsc = deadline > now_tsc ? deadline - now_tsc : 0;
+    // Convert TSC cycles to LAPIC timer counts, rounding up
+    const uint64_t counts = (remaining_tsc * (lapic_timer_freq / kTimerFreq) + counter_per_tick - 1) / counter_per_tick;
+    initial_count = std::clamp<uint64_t>(counts, 1, kCountMax);
 }
 
-bool TimerManager::Tick() {
-    ++tick_;
+}
+
+void InitializeLAPICTimer() {
+    timer_manager = new TimerManager;
+
+    divide_config = TIMER_FREQUENCY_RATE_PER_CPU_CLOCK_1;
+    lvt_timer = 0b001 << 16;
+
+    const uint64_t start_ns = NowNanoseconds();
+    StartLAPICTimer();
+    uint64_t elapsed_ns;
+    do {
+        elapsed_ns = NowNanoseconds() - start_ns;
+    } while (elapsed_ns < kLAPICCalibrationNanoseconds);
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+
+    lapic_timer_freq = static_cast<uint64_t>(elapsed) * 1000000000 / elapsed_ns;
+
+    timer_mode = DetectTicklessMode();
+    if (timer_mode == TimerMode::kPeriodic) {
+        Log(kInfo, "no invariant TSC or HPET one-shot timer. The timer stays periodic\n");
+        StartPeriodicTimer();
+        return;
+    }
+
+    if (timer_mode == TimerMode::kHPET) {
+        counter_per_tick = HPETFrequency() / kTimerFreq;
+        lvt_timer = kLVTMasked;
+    } else {
+        counter_per_tick = TSCFrequency() / kTimerFreq;
+    }
+    counter_base = ReadCounter();
+    if (timer_mode == TimerMode::kTSCDeadline) {
+        lvt_timer = kLVTTimerTSCDeadline | InterruptVector::kLAPICTimer;
+        // Orders the LVT write before the first write to IA32_TSC_DEADLINE
+        __builtin_ia32_mfence();
+    } else {
+        divide_config = TIMER_FREQUENCY_RATE_PER_CPU_CLOCK_1;
+        lvt_timer = kLVTTimerOneShot | InterruptVector::kLAPICTimer;
+    }
+    Log(kInfo, "tickless timer with %s\n",
+        timer_mode == TimerMode::kTSCDeadline ? "TSC deadline" :
+        timer_mode == TimerMode::kHPET ? "HPET" : "one-shot LAPIC timer");
+    bsp_apic_id = local_apic_id >> 24;
+    armed_tick = kMaxTicklessTicks;
+    ArmOneShot(armed_tick);
+}
 
+void InitializeAPLAPICTimer() {
+    // INIT leaves the local APIC software-disabled
+    spurious_interrupt_vector |= kAPICSoftwareEnable;
+    StartPeriodicTimer();
+}
+
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {}
+
+TimerManager::TimerManager() = default;
+
+void TimerManager::AddTimer(Timer& timer) {
+    SpinLockGuard guard{lock_};
+    Insert(timer, wheel_tick_ + 1);
+    ArmNextTimeout();
+}
+
+bool TimerManager::CancelTimer(Timer& timer) {
+    SpinLockGuard guard{lock_};
+    if (!timer.pending_) {
+        return false;
+    }
+    // An interrupt armed for the timer only finds nothing to expire
+    Remove(timer);
+    return true;
+}
+
+void TimerManager::SetTimeSlicing(bool enabled) {
+    SpinLockGuard guard{lock_};
+    time_slicing_ = enabled;
+    if (!enabled) {
+        if (task_timer_.pending_) Remove(task_timer_);
+    } else if (!task_timer_.pending_) {
+        task_timer_.SetTimeout(CurrentTick() + kTaskTimerPeriod);
+        Insert(task_timer_, wheel_tick_ + 1);
+        ArmNextTimeout();
+    }
+}
+
+unsigned long TimerManager::CurrentTick() const {
+    if (timer_mode == TimerMode::kPeriodic) {
+        return tick_;
+    }
+    return (ReadCounter() - counter_base) / counter_per_tick;
+}
+
+bool TimerManager::Tick() {
+    struct Expiry {
+        uint64_t task_id;
+        unsigned long timeout;
+        int value;
+    };
+    std::array<Expiry, kMaxExpiriesPerTick> expired;
+    int num_expired = 0;
     bool task_timer_timeout = false;
-    while(true) {
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_) { break; }
-
-        if (t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+
+    {
+        SpinLockGuard guard{lock_};
+        tick_ = timer_mode == TimerMode::kPeriodic ? tick_ + 1 : CurrentTick();
+
+        // A tickless interrupt may come several ticks after the previous one
+        while (true) {
+            auto& slot = wheel_[0][wheel_tick_ & (kWheelSlots - 1)];
+            while (slot && num_expired < kMaxExpiriesPerTick) {
+                Timer& t = *slot;
+                if (&t != &task_timer_) {
+                    expired[num_expired++] = {t.task_id_, t.timeout_, t.value_};
+                } else {
+                    task_timer_timeout = true;
+                }
+                // The owner may reuse the timer from here on
+                Remove(t);
+            }
+            if (slot || wheel_tick_ >= tick_) {
+                break;
+            }
+
+            ++wheel_tick_;
+            for (int level = 1; level < kWheelLevels; ++level) {
+                const int shift = kWheelSlotBits * level;
+                if (wheel_tick_ & ((1ul << shift) - 1)) {
+                    break;
+                }
+                Cascade(level, (wheel_tick_ >> shift) & (kWheelSlots - 1));
+            }
+        }
+
+        if (task_timer_timeout && time_slicing_) {
+            task_timer_.SetTimeout(tick_ + kTaskTimerPeriod);
+            Insert(task_timer_, wheel_tick_ + 1);
+        }
+        ArmNextTimeout();
+    }
+
+    for (int i = 0; i < num_expired; ++i) {
+        const auto& e = expired[i];
+        if (e.value == kTaskWakeupTimerValue) {
+            task_manager->WakeupBlocked(e.task_id);
             continue;
         }
 
         Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(1, m);
+        m.arg.timer.timeout = e.timeout;
+        m.arg.timer.value = e.value;
+        task_manager->SendMessage(e.task_id, m);
+    }
+    return task_timer_timeout;
+}
 
-        timers_.pop();
+void TimerManager::Insert(Timer& timer, unsigned long earliest) {
+    const unsigned long expires = std::max(timer.timeout_, earliest);
+    const unsigned long delta = expires - wheel_tick_;
+    int level = 0;
+    while (level < kWheelLevels - 1 && delta >> (kWheelSlotBits * (level + 1))) {
+        ++level;
     }
 
-    return task_timer_timeout;
+    // Timeouts beyond the range of the wheel wait in the last slot it
+    // reaches and are inserted again when it is cascaded
+    const unsigned long kWheelRange = 1ul << (kWheelSlotBits * kWheelLevels);
+    const unsigned long slot_tick = delta < kWheelRange ? expires : wheel_tick_ + kWheelRange - 1;
+    const int slot = (slot_tick >> (kWheelSlotBits * level)) & (kWheelSlots - 1);
+
+    auto& head = wheel_[level][slot];
+    timer.prev_ = nullptr;
+    timer.next_ = head;
+    if (head) {
+        head->prev_ = &timer;
+    }
+    head = &timer;
+    occupied_[level] |= 1ul << slot;
+
+    timer.level_ = level;
+    timer.slot_ = slot;
+    timer.pending_ = true;
+}
+
+void TimerManager::Remove(Timer& timer) {
+    auto& head = wheel_[timer.level_][timer.slot_];
+    if (timer.prev_) {
+        timer.prev_->next_ = timer.next_;
+    } else {
+        head = timer.next_;
+    }
+    if (timer.next_) {
+        timer.next_->prev_ = timer.prev_;
+    }
+    if (head == nullptr) {
+        occupied_[timer.level_] &= ~(1ul << timer.slot_);
+    }
+
+    timer.prev_ = timer.next_ = nullptr;
+    __atomic_store_n(&timer.pending_, false, __ATOMIC_RELEASE);
+}
+
+void TimerManager::Cascade(int level, int slot) {
+    Timer* t = wheel_[level][slot];
+    wheel_[level][slot] = nullptr;
+    occupied_[level] &= ~(1ul << slot);
+
+    while (t) {
+        Timer* next = t->next_;
+        // Timers due at the current tick go to the slot about to expire
+        Insert(*t, wheel_tick_);
+        t = next;
+    }
+}
+
+unsigned long TimerManager::NextEvent() const {
+    // Timeouts left by Tick
+    if (occupied_[0] & (1ul << (wheel_tick_ & (kWheelSlots - 1)))) {
+        return wheel_tick_;
+    }
+
+    unsigned long next = std::numeric_limits<unsigned long>::max();
+    for (int level = 0; level < kWheelLevels; ++level) {
+        if (occupied_[level] == 0) {
+            continue;
+        }
+
+        // Slots of a level are reached in turn, starting from the one after
+        // the current tick
+        const int shift = kWheelSlotBits * level;
+        const unsigned long base = (wheel_tick_ >> shift) + 1;
+        const int rotation = base & (kWheelSlots - 1);
+        uint64_t bits = occupied_[level];
+        if (rotation) {
+            bits = (bits >> rotation) | (bits << (kWheelSlots - rotation));
+        }
+        next = std::min(next, (base + __builtin_ctzl(bits)) << shift);
+    }
+    return next;
+}
+
+void TimerManager::ArmNextTimeout() {
+    if (timer_mode == TimerMode::kPeriodic) {
+        return;
+    }
+    // The cap bounds the ticks one interrupt walks the wheel through
+    const unsigned long next = std::min(NextEvent(), CurrentTick() + kMaxTicklessTicks);
+    if (CurrentCPUIndex() == 0) {
+        armed_tick = next;
+        ArmOneShot(next);
+    } else if (next < armed_tick) {
+        // The timer belongs to the bootstrap processor, which re-arms it
+        // from the interrupt
+        armed_tick = next;
+        while (icr_low & kICRDeliveryPending) __builtin_ia32_pause();
+        icr_high = static_cast<uint32_t>(bsp_apic_id) << 24;
+        icr_low = InterruptVector::kLAPICTimer;
+    }
+}
+
+unsigned long NanosecondsToTicks(uint64_t nsec) {
+    const uint64_t kNanosecondsPerTick = 1000000000 / kTimerFreq;
+    return (nsec + kNanosecondsPerTick - 1) / kNanosecondsPerTick;
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
 
 void LAPICTimerOnInterrupt() {
-    const bool task_timer_timeout = timer_manager->Tick();
+    const int cpu = CurrentCPUIndex();
+    const bool task_timer_timeout = cpu == 0
+        ? timer_manager->Tick()
+        : ++ap_ticks[cpu] % kTaskTimerPeriod == 0;
     NotifyEndOfInterrupt();
 
     if (task_timer_timeout) {
-        task_manager->SwitchTask();
+        PreemptFromInterrupt();
     }
 }
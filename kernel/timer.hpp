@@ -1,56 +1,127 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <vector>
+#include <limits>
 
 #include "logger.hpp"
 #include "message.hpp"
+#include "spinlock.hpp"
 
+// Needs InitializeHPET and InitializeClock, whose counters drive the
+// tickless modes
 void InitializeLAPICTimer();
-void StartLAPICTimer();
-uint32_t LAPICTimerElapsed();
-void StopLAPICTimer();
-
-template<typename Func, typename Logger>
-void measure_with_LAPICTimer(const char* tag, Logger logger, Func execute) {
-    StartLAPICTimer();
-    execute();
-    auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
-    logger("%s: elapsed = %f02\n", tag, (double)elapsed/1e6);
-}
+// Enables the local APIC of an application processor and starts its timer
+// with the frequency measured by InitializeLAPICTimer
+void InitializeAPLAPICTimer();
 
+const int kTimerFreq = 100;
+
+const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+const int kTaskTimerValue = std::numeric_limits<int>::min();
+// A timer with this value wakes its task up instead of sending a message
+const int kTaskWakeupTimerValue = kTaskTimerValue + 1;
+
+/**
+ * A timeout in the timer wheel of TimerManager. When it expires, the task
+ * task_id receives a kTimerTimeout message carrying the timeout and the
+ * value. Timers are owned by the caller, which must keep one alive while it
+ * is pending and passes it to CancelTimer to cancel it. The timeout can only
+ * be changed while the timer is not pending.
+ */
 class Timer {
 public:
-    Timer(unsigned long timeout, int value);
+    Timer(unsigned long timeout, int value, uint64_t task_id);
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
     unsigned long Timeout() const { return timeout_; }
+    void SetTimeout(unsigned long timeout) { timeout_ = timeout; }
     int Value() const { return value_; }
+    uint64_t TaskID() const { return task_id_; }
+    // TimerManager is done with the timer once this is false, so an expired
+    // timer can be destroyed without cancelling it
+    bool Pending() const { return __atomic_load_n(&pending_, __ATOMIC_ACQUIRE); }
+
 private:
+    friend class TimerManager;
+
     unsigned long timeout_;
     int value_;
+    uint64_t task_id_;
+    bool pending_{false};
+    // Position in the wheel while pending
+    uint8_t level_{0};
+    uint8_t slot_{0};
+    Timer* prev_{nullptr};
+    Timer* next_{nullptr};
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
-
+/**
+ * Timers of the bootstrap processor. When the CPU has an invariant TSC the
+ * LAPIC timer runs in tickless mode: it is armed as a one-shot, with the
+ * TSC-deadline mode if available, for the earliest timeout, and the
+ * current tick is derived from the TSC. Without an invariant TSC, a
+ * comparator of the HPET serves as the one-shot timer instead if it can
+ * deliver interrupts by FSB messages.
+ *
+ * Pending timers are kept in a hierarchical timing wheel of kWheelLevels
+ * levels. Level n has kWheelSlots slots of kWheelSlots^n ticks each, and the
+ * timers of a slot are moved to lower levels when the wheel reaches it, so
+ * adding, cancelling and expiring a timer take constant time. Any
+ * processor may add and cancel timers.
+ */
 class TimerManager {
 public:
+    static const int kWheelSlotBits = 6;
+    static const int kWheelSlots = 1 << kWheelSlotBits;
+    static const int kWheelLevels = 4;
+    // Tick delivers at most this number of timeouts and leaves the rest to
+    // an interrupt right after it
+    static const int kMaxExpiriesPerTick = 32;
+
     TimerManager();
-    void AddTimer(const Timer& timer);
+    // Adds a timer which is not pending. Timeouts which have passed expire
+    // at the next tick.
+    void AddTimer(Timer& timer);
+    // Returns false if the timer was not pending
+    bool CancelTimer(Timer& timer);
+    // Returns true when the task timer expired
     bool Tick();
-    unsigned long CurrentTick() const { return tick_; }
+    unsigned long CurrentTick() const;
+    // The scheduler turns the task timer on while more than one task is
+    // ready at the level of the running task, so an idle processor sleeps
+    // until the next timeout
+    void SetTimeSlicing(bool enabled);
 private:
+    // Guards the wheel. Tick releases it before delivering timeouts, which
+    // may wake tasks up and change the task timer.
+    SpinLock lock_;
     volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    // Timers with timeouts up to this tick have expired
+    unsigned long wheel_tick_{0};
+    std::array<std::array<Timer*, kWheelSlots>, kWheelLevels> wheel_{};
+    // Bit n is set while slot n of the level has timers
+    std::array<uint64_t, kWheelLevels> occupied_{};
+    Timer task_timer_{0, kTaskTimerValue, 0};
+    bool time_slicing_{false};
+
+    // Timers expire at the earliest tick if their timeout is before it
+    void Insert(Timer& timer, unsigned long earliest);
+    void Remove(Timer& timer);
+    // Re-inserts the timers of a slot, which the wheel has reached
+    void Cascade(int level, int slot);
+    // Returns the earliest tick at which a timer expires or is cascaded
+    unsigned long NextEvent() const;
+    void ArmNextTimeout();
 };
 
+// Number of ticks covering nsec, rounded up
+unsigned long NanosecondsToTicks(uint64_t nsec);
+
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
-
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
 
+// Only the bootstrap processor ticks timer_manager. Every processor switches
+// tasks every kTaskTimerPeriod ticks of its own timer.
 void LAPICTimerOnInterrupt();
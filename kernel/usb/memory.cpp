@@ -36,4 +36,8 @@ void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
 
 void FreeMem(void* p) {}
 
+size_t UsedMemBytes() {
+    return alloc_ptr - reinterpret_cast<uintptr_t>(memory_pool);
+}
+
 }
\ No newline at end of file
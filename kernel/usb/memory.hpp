@@ -18,4 +18,9 @@ T* AllocArray(size_t num_obj, unsigned int alignment, unsigned int boundary) {
 
 void FreeMem(void* p);
 
+/**
+ * Bytes of the pool handed out by AllocMem so far
+ */
+size_t UsedMemBytes();
+
 }
\ No newline at end of file
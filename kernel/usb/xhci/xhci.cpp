@@ -2,6 +2,7 @@
 
 #include "interrupt.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
 #include "pci.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/speed.hpp"
@@ -523,6 +524,11 @@ void Initialize() {
     // bitwise & with 0xfffffffffffffff0 (64 bit integer)
     const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
     Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
+    // A 64-bit BAR may lie above the identity mapped range
+    if (auto err = MapIdentity(xhc_mmio_base, 64 * 1024)) {
+        Log(kError, "failed to map xHC registers: %s\n", err.Name());
+        exit(1);
+    }
 
     usb::xhci::controller = new Controller{xhc_mmio_base};
     Controller& xhc = *usb::xhci::controller;
@@ -1,9 +1,25 @@
 #include "window.hpp"
 
+#include <atomic>
+
 #include "font.hpp"
 #include "logger.hpp"
 
+namespace {
+    // Windows may be created and destroyed by tasks on any processor
+    std::atomic<size_t> window_bytes{0};
+
+    size_t PixelBytes(int width, int height) {
+        // data_ and a 4-byte-per-pixel shadow buffer
+        return static_cast<size_t>(width) * height * (sizeof(PixelColor) + 4);
+    }
+}
+
+size_t WindowMemoryBytes() { return window_bytes; }
+
 Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
+    window_bytes += PixelBytes(width, height);
+
     data_.resize(height);
     for (int y = 0; y < height; ++y) {
         data_[y].resize(width);
@@ -20,6 +36,10 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
     }
 }
 
+Window::~Window() {
+    window_bytes -= PixelBytes(width_, height_);
+}
+
 void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area) {
     if (!transparent_color_) {
         Rectangle<int> window_area{pos, Size()};
@@ -22,7 +22,7 @@ private:
 };
 
     Window(int width, int height, PixelFormat shadow_format);
-    ~Window() = default;
+    ~Window();
     Window(const Window& rhs) = delete;
     Window& operator=(const Window& rhs) = delete;
 
@@ -48,5 +48,8 @@ private:
     FrameBuffer shadow_buffer_{};
 };
 
+// Bytes of pixel data held by all live windows
+size_t WindowMemoryBytes();
+
 void DrawWindow(PixelWriter& writer, const char* title);
 void DrawTextbox(PixelWriter& writer, Vector2D<int> pos, Vector2D<int> size);